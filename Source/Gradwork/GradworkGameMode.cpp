@@ -2,6 +2,7 @@
 
 #include "GradworkGameMode.h"
 #include "GradworkCharacter.h"
+#include "AgentSimulation.h"
 #include "UObject/ConstructorHelpers.h"
 #include "Kismet/GameplayStatics.h"
 
@@ -51,7 +52,67 @@ AOctree* AGradworkGameMode::GetOctree()
 	return Octree;
 }
 
+ALinearTree* AGradworkGameMode::GetLinearTree()
+{
+	if (!LinearTree)
+	{
+		TArray<AActor*> actors;
+		UGameplayStatics::GetAllActorsOfClass(GetWorld(), ALinearTree::StaticClass(), actors);
+		// the level doesn't have to contain one, spawn it on demand
+		LinearTree = actors.IsEmpty() ? GetWorld()->SpawnActor<ALinearTree>() : Cast<ALinearTree>(actors[0]);
+		LinearTree->bPlanar = treeType == ETreeType::linearquadtree;
+	}
+	if (!LinearTree->IsBuilt())
+	{
+		// same world bounds as the octree that gets built in the level
+		LinearTree->Build(GetOctree()->GetWorldBounds());
+	}
+	return LinearTree;
+}
+
+ASpatialHashGrid* AGradworkGameMode::GetHashGrid()
+{
+	if (!HashGrid)
+	{
+		TArray<AActor*> actors;
+		UGameplayStatics::GetAllActorsOfClass(GetWorld(), ASpatialHashGrid::StaticClass(), actors);
+		// the level doesn't have to contain one, spawn it on demand
+		HashGrid = actors.IsEmpty() ? GetWorld()->SpawnActor<ASpatialHashGrid>() : Cast<ASpatialHashGrid>(actors[0]);
+	}
+	if (!HashGrid->IsBuilt())
+	{
+		// same world bounds as the octree that gets built in the level
+		HashGrid->Build(GetOctree()->GetWorldBounds());
+	}
+	return HashGrid;
+}
+
+AAgentSimulation* AGradworkGameMode::GetAgentSimulation()
+{
+	// the linear trees rebuild from actor transforms every frame, there's nothing to drive in batch there
+	if (!bUseAgentSimulation || treeType == ETreeType::linearoctree || treeType == ETreeType::linearquadtree)
+	{
+		return nullptr;
+	}
+	if (!AgentSimulation)
+	{
+		TArray<AActor*> actors;
+		UGameplayStatics::GetAllActorsOfClass(GetWorld(), AAgentSimulation::StaticClass(), actors);
+		// the level doesn't have to contain one, spawn it on demand
+		AgentSimulation = actors.IsEmpty() ? GetWorld()->SpawnActor<AAgentSimulation>() : Cast<AAgentSimulation>(actors[0]);
+	}
+	return AgentSimulation;
+}
+
 ETreeType AGradworkGameMode::GetTreeType() const
 {
 	return treeType;
 }
+
+void AGradworkGameMode::RegisterNeighbourSkin(float skin)
+{
+	if (skin > 0.f)
+	{
+		NeighbourSkin = NeighbourSkin > 0.f ? FMath::Min(NeighbourSkin, skin) : skin;
+	}
+}
@@ -6,13 +6,21 @@
 #include "GameFramework/GameModeBase.h"
 #include "QuadTree.h"
 #include "Octree.h"
+#include "LinearTree.h"
+#include "SpatialHashGrid.h"
 #include "GradworkGameMode.generated.h"
+class AAgentSimulation;
 UENUM(BlueprintType)
 enum class ETreeType : uint8 
 {
 	none,
 	quadtree,
-	octree
+	octree,
+	// Morton sorted trees rebuilt every frame, see ALinearTree
+	linearoctree,
+	linearquadtree,
+	// uniform grid baseline, see ASpatialHashGrid
+	hashgrid
 };
 UCLASS(minimalapi)
 class AGradworkGameMode : public AGameModeBase
@@ -23,12 +31,31 @@ public:
 	virtual void StartPlay() override;
 	AQuadTree* GetQuadTree() ;
 	AOctree* GetOctree() ;
+	ALinearTree* GetLinearTree();
+	ASpatialHashGrid* GetHashGrid();
+	// nullptr when the agents tick themselves
+	AAgentSimulation* GetAgentSimulation();
 	ETreeType GetTreeType()const;
 	UPROPERTY(EditAnywhere,BlueprintReadWrite)
 	ETreeType treeType = ETreeType::quadtree;
+	// step every agent from one AAgentSimulation instead of per actor ticks. the linear trees always use per actor ticks
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bUseAgentSimulation = false;
+	// The agents' Verlet lists go stale together. An agent that got more than half the smallest skin away from where
+	// it was when the lists were taken bumps the epoch, and every list gets requeried on its next use.
+	int32 GetNeighbourListEpoch() const { return NeighbourListEpoch; }
+	void InvalidateNeighbourLists() { ++NeighbourListEpoch; }
+	// smallest NeighbourSkin any agent keeps a list with, 0 while none does
+	float GetNeighbourSkin() const { return NeighbourSkin; }
+	void RegisterNeighbourSkin(float skin);
 private:
+	int32 NeighbourListEpoch = 0;
+	float NeighbourSkin = 0.f;
 	AQuadTree* QuadTree;
 	AOctree* Octree;
+	ALinearTree* LinearTree;
+	ASpatialHashGrid* HashGrid;
+	AAgentSimulation* AgentSimulation;
 };
 
 
@@ -4,6 +4,8 @@
 #include "Agent.h"
 #include "Kismet/GameplayStatics.h"
 #include "Gradwork/GradworkGameMode.h"
+#include "AgentSimulation.h"
+#include "Steering.h"
 // Sets default values
 AAgent::AAgent()
 {
@@ -17,6 +19,7 @@ void AAgent::BeginPlay()
 {
 	Super::BeginPlay();
 	auto gameMode = Cast<AGradworkGameMode>(UGameplayStatics::GetGameMode(GetWorld()));
+	GameMode = gameMode;
 	TreeType = gameMode->GetTreeType();
 	switch (TreeType)
 	{
@@ -29,25 +32,55 @@ void AAgent::BeginPlay()
 	case ETreeType::quadtree:
 		QuadTree = gameMode->GetQuadTree();
 		QuadTree->Insert(this);
+		// the tree moves everyone that changed leaves in its own tick, before we query it
+		AddTickPrerequisiteActor(QuadTree);
 
 		break;
 	case ETreeType::octree:
 		Octree = gameMode->GetOctree();
 		Octree->Insert(this);
+		// the tree moves everyone that changed leaves in its own tick, before we query it
+		AddTickPrerequisiteActor(Octree);
+
+		break;
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+		LinearTree = gameMode->GetLinearTree();
+		LinearTree->Insert(this);
+		// the tree rebuilds in its own tick, make sure that happens before we query it
+		AddTickPrerequisiteActor(LinearTree);
+
+		break;
+	case ETreeType::hashgrid:
+		HashGrid = gameMode->GetHashGrid();
+		HashGrid->Insert(this);
+		// the grid moves everyone that changed cells in its own tick, before we query it
+		AddTickPrerequisiteActor(HashGrid);
 
 		break;
 	default:
 		break;
 	}
 	OtherActors.Reserve(100);
+	// nobody's list has this agent in it yet
+	gameMode->RegisterNeighbourSkin(NeighbourSkin);
+	gameMode->InvalidateNeighbourLists();
+	NeighbourListOrigin = GetActorLocation();
 
 	Direction.X = FMath::Rand() % 2 ? 1 : -1;
 	Direction.Y = FMath::Rand() % 2 ? 1 : -1;
 	Direction.Z = FMath::Rand() % 2 ? 1 : -1;
 
-	SteeringType = ESteeringType::seperation;
+	SteeringType = bBlendedSteering ? ESteeringType::weighted : ESteeringType::seperation;
 	//SteeringType = ESteeringType(FMath::RandRange(0,2));
 
+	// the simulation steps this agent together with all the others from now on
+	if (AAgentSimulation* simulation = gameMode->GetAgentSimulation())
+	{
+		SetActorTickEnabled(false);
+		simulation->AddAgent(this);
+	}
+
 }
 
 // Called every frame
@@ -89,6 +122,20 @@ void AAgent::Tick(float DeltaTime)
 			flockingVector /= OtherActors.Num();
 			//flockingVector.Normalize();
 			break;
+		case ESteeringType::weighted:
+		{
+			// pack the neighbours once, then all three behaviours come out of one pass
+			Steering::FNeighbourData neighbours;
+			for (auto& neighbour : OtherActors)
+			{
+				AAgent* agent = Cast<AAgent>(neighbour);
+				neighbours.Add(FVector3f(neighbour->GetActorLocation()), agent ? FVector3f(agent->Direction * agent->Speed) : FVector3f::ZeroVector);
+			}
+			const FVector3f position(GetActorLocation());
+			const Steering::FNeighbourSums sums = Steering::Accumulate(neighbours, position, seperationRange);
+			flockingVector = FVector(Steering::Blend(sums, position, seperationWeight, allignmentWeight, cohesionWeight));
+			break;
+		}
 		default:
 			GEngine->AddOnScreenDebugMessage(-1, 1.f, FColor::Emerald, TEXT(" no valid steering enum"));
 			break;
@@ -123,9 +170,9 @@ void AAgent::Tick(float DeltaTime)
 			Direction.Y = FMath::Rand() % 2 ? 1 : -1;
 			Direction.Z = FMath::Rand() % 2 ? 1 : -1;
 		}
-		if (quadQueryResponder && !quadQueryResponder->Bounds.IsInside(FVector2D(this->GetActorLocation())))
+		// moving between leaves is handled by the tree's UpdateAll, we only need to get back in when it dropped us
+		if (quadQueryResponder == INDEX_NONE)
 		{
-			QuadTree->RemoveActorFromNode(quadQueryResponder, this);
 			QuadTree->Insert(this);
 		}
 		break;
@@ -139,34 +186,151 @@ void AAgent::Tick(float DeltaTime)
 			Direction.Y = FMath::Rand() % 2 ? 1 : -1;
 			Direction.Z = FMath::Rand() % 2 ? 1 : -1;
 		}
-		if (octQueryResponder && !octQueryResponder->Bounds.IsInside(this->GetActorLocation()))
+		// moving between leaves is handled by the tree's UpdateAll, we only need to get back in when it dropped us
+		if (octQueryResponder == INDEX_NONE)
 		{
-			Octree->RemoveActorFromNode(octQueryResponder, this);
 			Octree->Insert(this);
 		}
 		break;
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+		// no remove/reinsert, the tree sorts everyone into place on its next rebuild
+		if (!LinearTree->IsInsideBounds(this))
+		{
+			FVector loc = FMath::RandPointInBox(LinearTree->GetWorldBounds());
+			SetActorLocation(loc, false);
+
+			Direction.X = FMath::Rand() % 2 ? 1 : -1;
+			Direction.Y = FMath::Rand() % 2 ? 1 : -1;
+			Direction.Z = FMath::Rand() % 2 ? 1 : -1;
+		}
+		break;
+	case ETreeType::hashgrid:
+		// the grid keeps everyone in a border cell, no reinsert needed after teleporting
+		if (!HashGrid->IsInsideBounds(this))
+		{
+			FVector loc = FMath::RandPointInBox(HashGrid->GetWorldBounds());
+			SetActorLocation(loc, false);
+
+			Direction.X = FMath::Rand() % 2 ? 1 : -1;
+			Direction.Y = FMath::Rand() % 2 ? 1 : -1;
+			Direction.Z = FMath::Rand() % 2 ? 1 : -1;
+		}
+		break;
 	default:
 		break;
 	}
-	
+	CheckNeighbourListDisplacement();
 }
 
 void AAgent::QueryTree()
+{
+	// agents without a list of their own still measure how far they got, they can be in everyone else's list
+	const int32 epoch = GameMode->GetNeighbourListEpoch();
+	const bool bNewEpoch = NeighbourListEpoch != epoch;
+	if (bNewEpoch)
+	{
+		NeighbourListOrigin = GetActorLocation();
+		NeighbourListEpoch = epoch;
+	}
+	if (NeighbourSkin <= 0.f || TreeType == ETreeType::none)
+	{
+		QueryNeighbours(seperationRange, MaxNeighbours, OtherActors);
+		return;
+	}
+	if (bNewEpoch)
+	{
+		// every neighbour, the closest MaxNeighbours get picked per frame from the list
+		QueryNeighbours(seperationRange + NeighbourSkin, 0, NeighbourList);
+	}
+	FilterNeighbourList();
+}
+
+void AAgent::CheckNeighbourListDisplacement()
+{
+	const float halfSkin = GameMode->GetNeighbourSkin() * 0.5f;
+	// a respawn or a fast agent can outrun the skin of every list it is in, not only its own
+	if (halfSkin > 0.f && FVector::DistSquared(GetActorLocation(), NeighbourListOrigin) > halfSkin * halfSkin)
+	{
+		GameMode->InvalidateNeighbourLists();
+	}
+}
+
+void AAgent::QueryNeighbours(float range, int32 maxNeighbours, TArray<AActor*>& outActors)
 {
 	switch (TreeType)
 	{
 	case ETreeType::none:
 
 		break;
+	// the range queries return the complete neighbourhood every frame, so last frame's list can go
 	case ETreeType::quadtree:
-		QuadTree->Query(FVector2D(this->GetActorLocation()), OtherActors,this);
+		outActors.Reset();
+		if (maxNeighbours > 0)
+		{
+			QuadTree->QueryKNearest(GetActorLocation(), maxNeighbours, range, outActors, this);
+			break;
+		}
+		QuadTree->QueryCircle(GetActorLocation(), range, outActors, this);
 		break;
 	case ETreeType::octree:
-		Octree->Query(GetActorLocation(), OtherActors, this);
+		outActors.Reset();
+		if (maxNeighbours > 0)
+		{
+			Octree->QueryKNearest(GetActorLocation(), maxNeighbours, range, outActors, this);
+			break;
+		}
+		Octree->QuerySphere(GetActorLocation(), range, outActors, this);
 
+		break;
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+		outActors.Reset();
+		LinearTree->QuerySphere(GetActorLocation(), range, outActors, this);
+		break;
+	case ETreeType::hashgrid:
+		outActors.Reset();
+		HashGrid->QuerySphere(GetActorLocation(), range, outActors, this);
 		break;
 	default:
 		break;
 	}
 }
 
+void AAgent::FilterNeighbourList()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AAgent_FilterNeighbourList)
+	const FVector location = GetActorLocation();
+	const bool bPlanar = TreeType == ETreeType::quadtree || TreeType == ETreeType::linearquadtree;
+	const float zHeightTolerance = TreeType == ETreeType::quadtree ? QuadTree->zHeightTolerance : bPlanar ? LinearTree->zHeightTolerance : 0.f;
+	// same shape as the tree query, the planar trees measure on XY and keep a height band
+	auto distanceSquared = [&location, bPlanar](const AActor* actor)
+	{
+		const FVector offset = actor->GetActorLocation() - location;
+		return bPlanar ? offset.SizeSquared2D() : offset.SizeSquared();
+	};
+	const float rangeSquared = seperationRange * seperationRange;
+	OtherActors.Reset();
+	for (AActor* neighbour : NeighbourList)
+	{
+		// the list can outlive a neighbour
+		if (!IsValid(neighbour) || distanceSquared(neighbour) > rangeSquared)
+		{
+			continue;
+		}
+		if (bPlanar && FMath::Abs(neighbour->GetActorLocation().Z - location.Z) >= zHeightTolerance)
+		{
+			continue;
+		}
+		OtherActors.Add(neighbour);
+	}
+	// only the trees have k nearest queries, the others hand back everything in range
+	const bool bKNearest = MaxNeighbours > 0 && (TreeType == ETreeType::quadtree || TreeType == ETreeType::octree);
+	if (bKNearest && OtherActors.Num() > MaxNeighbours)
+	{
+		// nearest first, like the k nearest queries hand them out
+		OtherActors.Sort([&distanceSquared](const AActor& a, const AActor& b) { return distanceSquared(&a) < distanceSquared(&b); });
+		OtherActors.SetNum(MaxNeighbours, false);
+	}
+}
+
@@ -0,0 +1,363 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "AgentSimulation.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Kismet/GameplayStatics.h"
+#include "Async/ParallelFor.h"
+#include "Gradwork/GradworkGameMode.h"
+
+// Sets default values
+AAgentSimulation::AAgentSimulation()
+{
+	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+	// the tree update is part of our step now, so we go in the same group the trees used
+	PrimaryActorTick.TickGroup = TG_PrePhysics;
+}
+
+// Called when the game starts or when spawned
+void AAgentSimulation::BeginPlay()
+{
+	Super::BeginPlay();
+	Initialise();
+}
+
+void AAgentSimulation::EndPlay(EEndPlayReason::Type reason)
+{
+	Super::EndPlay(reason);
+	Recorder.Close();
+
+	UpdateLatency.Log(TEXT("AGENT SIMULATION"), TEXT("Update"));
+	QueryLatency.Log(TEXT("AGENT SIMULATION"), TEXT("Query"));
+	SteerLatency.Log(TEXT("AGENT SIMULATION"), TEXT("Steer"));
+	TransformLatency.Log(TEXT("AGENT SIMULATION"), TEXT("Transform"));
+}
+
+void AAgentSimulation::Initialise()
+{
+	if (bInitialised)
+	{
+		return;
+	}
+	bInitialised = true;
+	auto gameMode = Cast<AGradworkGameMode>(UGameplayStatics::GetGameMode(GetWorld()));
+	TreeType = gameMode->GetTreeType();
+	// we feed the structure our own positions, it must not read the actor transforms in its own tick anymore
+	switch (TreeType)
+	{
+	case ETreeType::none:
+		// octree bounds is being used just for simplicity sake, same as the agents do
+		Octree = gameMode->GetOctree();
+		WorldBounds = Octree->GetWorldBounds();
+		break;
+	case ETreeType::quadtree:
+		QuadTree = gameMode->GetQuadTree();
+		QuadTree->bUpdateInTick = false;
+		WorldBounds = QuadTree->GetWorldBounds();
+		break;
+	case ETreeType::octree:
+		Octree = gameMode->GetOctree();
+		Octree->bUpdateInTick = false;
+		WorldBounds = Octree->GetWorldBounds();
+		break;
+	case ETreeType::hashgrid:
+		HashGrid = gameMode->GetHashGrid();
+		HashGrid->bUpdateInTick = false;
+		WorldBounds = HashGrid->GetWorldBounds();
+		break;
+	default:
+		break;
+	}
+}
+
+FVector3f AAgentSimulation::RandomDirection(FRandomStream& stream)
+{
+	return FVector3f(stream.RandHelper(2) ? 1 : -1, stream.RandHelper(2) ? 1 : -1, stream.RandHelper(2) ? 1 : -1);
+}
+
+void AAgentSimulation::AddAgent(AAgent* agent)
+{
+	Initialise();
+	// the batch update only moves what is already in the tree, so start everyone inside the bounds
+	if (!WorldBounds.IsInside(agent->GetActorLocation()))
+	{
+		agent->SetActorLocation(FMath::RandPointInBox(WorldBounds), false);
+	}
+
+	const int32 agentIndex = Agents.Add(agent);
+	Positions.Add(FVector3f(agent->GetActorLocation()));
+	Directions.Add(FVector3f(agent->Direction));
+	Speeds.Add(agent->Speed);
+	SteeringTypes.Add(agent->SteeringType);
+	SeparationRanges.Add(agent->seperationRange);
+	SeparationWeights.Add(agent->seperationWeight);
+	AlignmentWeights.Add(agent->allignmentWeight);
+	CohesionWeights.Add(agent->cohesionWeight);
+	QueryRadius = FMath::Max(QueryRadius, agent->seperationRange);
+	// agents that were set up for k nearest keep getting it
+	MaxNeighbours = FMath::Max(MaxNeighbours, agent->MaxNeighbours);
+
+	int32 handle = INDEX_NONE;
+	switch (TreeType)
+	{
+	case ETreeType::quadtree:
+		// BeginPlay only got it in when it started inside the bounds
+		if (agent->quadQueryResponder == INDEX_NONE)
+		{
+			QuadTree->Insert(agent);
+		}
+		handle = QuadTree->GetHandle(agent);
+		break;
+	case ETreeType::octree:
+		if (agent->octQueryResponder == INDEX_NONE)
+		{
+			Octree->Insert(agent);
+		}
+		handle = Octree->GetHandle(agent);
+		break;
+	case ETreeType::hashgrid:
+		HashGrid->Insert(agent);
+		handle = HashGrid->GetHandle(agent);
+		break;
+	default:
+		break;
+	}
+	AgentHandles.Add(handle);
+	if (handle != INDEX_NONE)
+	{
+		while (HandleAgents.Num() <= handle)
+		{
+			HandleAgents.Add(INDEX_NONE);
+		}
+		HandleAgents[handle] = agentIndex;
+	}
+
+	if (InstancedMesh)
+	{
+		InstanceTransforms.Add(agent->GetActorTransform());
+		InstancedMesh->AddInstance(agent->GetActorTransform(), true);
+	}
+}
+
+void AAgentSimulation::UpdateTree()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AAgentSimulation_UpdateTree)
+	switch (TreeType)
+	{
+	case ETreeType::quadtree:
+		QuadTree->UpdateFromPositions(Positions, HandleAgents);
+		break;
+	case ETreeType::octree:
+		Octree->UpdateFromPositions(Positions, HandleAgents);
+		break;
+	case ETreeType::hashgrid:
+		HashGrid->UpdateFromPositions(Positions, HandleAgents);
+		break;
+	default:
+		break;
+	}
+}
+
+void AAgentSimulation::QueryNeighbours()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AAgentSimulation_QueryNeighbours)
+	switch (TreeType)
+	{
+	case ETreeType::none:
+	{
+		// no structure to ask, so everyone tests everyone
+		const float radiusSquared = QueryRadius * QueryRadius;
+		Neighbours.Fill(Positions.Num(), [this, radiusSquared](int32 agentIndex, TArray<int32>& out)
+		{
+			for (int32 other = 0; other < Positions.Num(); ++other)
+			{
+				if (other != agentIndex && FVector3f::DistSquared(Positions[other], Positions[agentIndex]) <= radiusSquared)
+				{
+					out.Add(other);
+				}
+			}
+		});
+		// already agent indices
+		return;
+	}
+	case ETreeType::quadtree:
+		if (bGroupQueriesByLeaf)
+		{
+			// the tree holds this step's positions since UpdateTree, so it can measure from its own copies
+			QuadTree->QueryBatchByLeaf(QueryRadius, MaxNeighbours, Positions.Num(), HandleAgents, Neighbours);
+			break;
+		}
+		QuadTree->QueryBatchHandles(Positions, QueryRadius, MaxNeighbours, Neighbours, AgentHandles);
+		break;
+	case ETreeType::octree:
+		if (bGroupQueriesByLeaf)
+		{
+			Octree->QueryBatchByLeaf(QueryRadius, MaxNeighbours, Positions.Num(), HandleAgents, Neighbours);
+			break;
+		}
+		Octree->QueryBatchHandles(Positions, QueryRadius, MaxNeighbours, Neighbours, AgentHandles);
+		break;
+	case ETreeType::hashgrid:
+		HashGrid->QueryBatchHandles(Positions, QueryRadius, Neighbours, AgentHandles);
+		break;
+	default:
+		break;
+	}
+	for (int32& neighbour : Neighbours.Neighbours)
+	{
+		neighbour = HandleAgents.IsValidIndex(neighbour) ? HandleAgents[neighbour] : INDEX_NONE;
+	}
+}
+
+void AAgentSimulation::SteerAgent(int32 agentIndex, float deltaTime, Steering::FNeighbourData& scratch)
+{
+	const FVector3f position = Positions[agentIndex];
+	const float speed = Speeds[agentIndex];
+	FVector3f flockingVector = FVector3f::ZeroVector;
+	if (SteeringTypes[agentIndex] == ESteeringType::weighted)
+	{
+		// pack the neighbours once, then all three behaviours come out of one pass
+		scratch.Reset();
+		for (int32 neighbour : Neighbours.GetNeighbours(agentIndex))
+		{
+			if (neighbour != INDEX_NONE)
+			{
+				scratch.Add(Positions[neighbour], Directions[neighbour] * Speeds[neighbour]);
+			}
+		}
+		const Steering::FNeighbourSums sums = Steering::Accumulate(scratch, position, SeparationRanges[agentIndex]);
+		flockingVector = Steering::Blend(sums, position, SeparationWeights[agentIndex], AlignmentWeights[agentIndex], CohesionWeights[agentIndex]);
+	}
+	else
+	{
+		int32 numNeighbours = 0;
+		for (int32 neighbour : Neighbours.GetNeighbours(agentIndex))
+		{
+			// actors that were put in the tree by someone else don't take part in the flocking
+			if (neighbour == INDEX_NONE)
+			{
+				continue;
+			}
+			++numNeighbours;
+			switch (SteeringTypes[agentIndex])
+			{
+			case ESteeringType::seperation:
+			{
+				const FVector3f toNeighbour = Positions[neighbour] - position;
+				const float distance = toNeighbour.Size();
+				if (distance > 0.f && distance < SeparationRanges[agentIndex])
+				{
+					flockingVector -= toNeighbour / distance;
+				}
+				break;
+			}
+			case ESteeringType::allignment:
+				flockingVector += Directions[neighbour] * speed;
+				break;
+			case ESteeringType::cohesion:
+				flockingVector += Positions[neighbour];
+				break;
+			default:
+				break;
+			}
+		}
+		if (SteeringTypes[agentIndex] == ESteeringType::cohesion && numNeighbours > 0)
+		{
+			flockingVector /= numNeighbours;
+		}
+	}
+
+	FVector3f finalDirection = (Directions[agentIndex] * 1.f + flockingVector * 5.f);
+	finalDirection.Normalize();
+	FVector3f& nextPosition = NextPositions[agentIndex];
+	FVector3f& nextDirection = NextDirections[agentIndex];
+	nextPosition = position + finalDirection * speed * deltaTime;
+	nextDirection = Directions[agentIndex];
+	if (!WorldBounds.IsInside(FVector(nextPosition)))
+	{
+		// seeded per agent and step, so the respawn doesn't depend on which thread got here first
+		FRandomStream stream(int32(HashCombine(HashCombine(GetTypeHash(Seed), GetTypeHash(StepCount)), GetTypeHash(agentIndex))));
+		const FVector min = WorldBounds.Min;
+		const FVector max = WorldBounds.Max;
+		nextPosition = FVector3f(stream.FRandRange(min.X, max.X), stream.FRandRange(min.Y, max.Y), stream.FRandRange(min.Z, max.Z));
+		nextDirection = RandomDirection(stream);
+	}
+}
+
+void AAgentSimulation::Steer(float deltaTime)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AAgentSimulation_Steer)
+	NextPositions.SetNumUninitialized(Positions.Num());
+	NextDirections.SetNumUninitialized(Directions.Num());
+	// every agent only writes its own slot of the next buffers, so the order the agents run in doesn't matter
+	const int32 numChunks = FMath::DivideAndRoundUp(Positions.Num(), SteerChunkSize);
+	ParallelFor(numChunks, [this, deltaTime](int32 chunkIndex)
+	{
+		Steering::FNeighbourData scratch;
+		const int32 end = FMath::Min((chunkIndex + 1) * SteerChunkSize, Positions.Num());
+		for (int32 agentIndex = chunkIndex * SteerChunkSize; agentIndex < end; ++agentIndex)
+		{
+			SteerAgent(agentIndex, deltaTime, scratch);
+		}
+	}, bParallelSteer ? EParallelForFlags::None : EParallelForFlags::ForceSingleThread);
+	Swap(Positions, NextPositions);
+	Swap(Directions, NextDirections);
+}
+
+void AAgentSimulation::PushTransforms()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AAgentSimulation_PushTransforms)
+	if (bPushToActors)
+	{
+		for (int32 agentIndex = 0; agentIndex < Agents.Num(); ++agentIndex)
+		{
+			if (IsValid(Agents[agentIndex]))
+			{
+				Agents[agentIndex]->SetActorLocation(FVector(Positions[agentIndex]), false);
+			}
+		}
+	}
+	if (InstancedMesh && InstanceTransforms.Num() == Positions.Num())
+	{
+		for (int32 agentIndex = 0; agentIndex < Positions.Num(); ++agentIndex)
+		{
+			InstanceTransforms[agentIndex].SetLocation(FVector(Positions[agentIndex]));
+		}
+		InstancedMesh->BatchUpdateInstancesTransforms(0, InstanceTransforms, true, true);
+	}
+}
+
+// Called every frame
+void AAgentSimulation::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+	if (Agents.IsEmpty())
+	{
+		return;
+	}
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkStepUpdate, &UpdateLatency);
+		UpdateTree();
+	}
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkStepQuery, &QueryLatency);
+		QueryNeighbours();
+	}
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkStepSteer, &SteerLatency);
+		Steer(DeltaTime);
+	}
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkStepTransform, &TransformLatency);
+		PushTransforms();
+	}
+
+	// opened on the first step, by then every agent in the level has registered
+	if (!RecordPath.IsEmpty() && !Recorder.IsOpen() && !bRecordingFailed)
+	{
+		bRecordingFailed = !Recorder.Open(RecordPath, Positions.Num(), WorldBounds);
+	}
+	Recorder.AddFrame(Positions);
+	++StepCount;
+}
@@ -0,0 +1,751 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "GradworkBenchmarkCommandlet.h"
+#include "QuadTree.h"
+#include "Octree.h"
+#include "LinearTree.h"
+#include "SpatialHashGrid.h"
+#include "Steering.h"
+#include "Engine/Engine.h"
+#include "Engine/World.h"
+#include "Components/SceneComponent.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace
+{
+	// fixed step and flocking settings, so runs only differ in what the command line changes
+	constexpr float StepTime = 1.f / 60.f;
+	constexpr float AgentSpeed = 200.f;
+	constexpr float SeparationWeight = 1.f;
+	constexpr float AlignmentWeight = 0.5f;
+	constexpr float CohesionWeight = 0.1f;
+	constexpr int32 ClusterCount = 16;
+	constexpr float PlanarThickness = 100.f;
+	// everyone against everyone gets out of hand past this, the sweep leaves brute force out above it
+	constexpr int32 MaxBruteForceAgents = 20000;
+
+	// a bare actor with a movable root, all the structures need from an agent is a location
+	AActor* SpawnAgent(UWorld* world, const FVector& location)
+	{
+		AActor* actor = world->SpawnActor<AActor>();
+		USceneComponent* root = NewObject<USceneComponent>(actor);
+		root->SetMobility(EComponentMobility::Movable);
+		actor->SetRootComponent(root);
+		root->RegisterComponent();
+		actor->SetActorLocation(location, false);
+		return actor;
+	}
+
+	FVector3f RandomPoint(FRandomStream& stream, const FBox& bounds)
+	{
+		return FVector3f(stream.FRandRange(bounds.Min.X, bounds.Max.X), stream.FRandRange(bounds.Min.Y, bounds.Max.Y), stream.FRandRange(bounds.Min.Z, bounds.Max.Z));
+	}
+
+	// Box-Muller, FRandomStream only does uniform
+	float RandomGaussian(FRandomStream& stream)
+	{
+		const float u = FMath::Max(stream.GetFraction(), UE_SMALL_NUMBER);
+		return FMath::Sqrt(-2.f * FMath::Loge(u)) * FMath::Cos(UE_TWO_PI * stream.GetFraction());
+	}
+
+	const TCHAR* GetDistributionName(EBenchmarkDistribution distribution)
+	{
+		switch (distribution)
+		{
+		case EBenchmarkDistribution::Clustered:
+			return TEXT("clustered");
+		case EBenchmarkDistribution::Planar:
+			return TEXT("planar");
+		default:
+			return TEXT("uniform");
+		}
+	}
+
+	TArray<int32> ParseIntList(const FString& params, const TCHAR* key, TArray<int32> defaults)
+	{
+		FString value;
+		if (!FParse::Value(*params, key, value, false))
+		{
+			return defaults;
+		}
+		TArray<FString> entries;
+		value.ParseIntoArray(entries, TEXT(","));
+		TArray<int32> values;
+		for (const FString& entry : entries)
+		{
+			values.Add(FCString::Atoi(*entry));
+		}
+		return values;
+	}
+
+	const TCHAR* CsvHeader = TEXT("Distribution,Agents,TreeType,MaxDepth,MaxActorsPerNode,CellSize,BuildMs,InsertMs,UpdateMs,QueryMs,SteerMs,StepMs,UpdateP95Ms,UpdateP99Ms,QueryP95Ms,QueryP99Ms,SteerP95Ms,SteerP99Ms,AgentsPerSecond,Nodes,AverageNeighbours,BytesPerAgent\n");
+
+	// scenario is the distribution, or the trajectory file for replays
+	FString FormatRow(const FString& scenario, int32 numAgents, const FGradworkBenchmarkResult& result)
+	{
+		const FString name = StaticEnum<ETreeType>()->GetNameStringByValue(int64(result.TreeType));
+		return FString::Printf(TEXT("%s,%d,%s,%d,%d,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%d,%f,%f\n"), *scenario, numAgents, *name,
+			result.Config.MaxDepth, result.Config.MaxActorsPerNode, result.Config.CellSize, result.Build.GetMeanMs(), result.Insert.GetMeanMs(),
+			result.Update.GetMeanMs(), result.Query.GetMeanMs(), result.Steer.GetMeanMs(), result.GetStepTime(),
+			result.Update.GetPercentileMs(95.0), result.Update.GetPercentileMs(99.0), result.Query.GetPercentileMs(95.0),
+			result.Query.GetPercentileMs(99.0), result.Steer.GetPercentileMs(95.0), result.Steer.GetPercentileMs(99.0),
+			result.GetThroughput(numAgents), result.NodeCount, result.AverageNeighbours, result.BytesPerAgent);
+	}
+
+	// percentiles of the per step phases, the summary line only has the means
+	void LogPhases(const FGradworkBenchmarkResult& result)
+	{
+		const FString owner = FString(TEXT("GradworkBenchmark ")) + StaticEnum<ETreeType>()->GetNameStringByValue(int64(result.TreeType));
+		result.Update.Log(*owner, TEXT("Update"));
+		result.Query.Log(*owner, TEXT("Query"));
+		result.Steer.Log(*owner, TEXT("Steer"));
+	}
+}
+
+UGradworkBenchmarkCommandlet::UGradworkBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsEditor = false;
+	IsServer = false;
+	LogToConsole = true;
+}
+
+int32 UGradworkBenchmarkCommandlet::Main(const FString& params)
+{
+	float extent = 5000.f;
+	FString types;
+	FString distributionName;
+	FString recordPath;
+	FString replayPath;
+	FString outPath = FPaths::ProjectSavedDir() / TEXT("Benchmarks") / TEXT("GradworkBenchmark.csv");
+	FParse::Value(*params, TEXT("agents="), NumAgents);
+	FParse::Value(*params, TEXT("steps="), NumSteps);
+	FParse::Value(*params, TEXT("radius="), QueryRadius);
+	FParse::Value(*params, TEXT("extent="), extent);
+	FParse::Value(*params, TEXT("seed="), Seed);
+	FParse::Value(*params, TEXT("types="), types, false);
+	FParse::Value(*params, TEXT("distribution="), distributionName);
+	FParse::Value(*params, TEXT("out="), outPath);
+	FParse::Value(*params, TEXT("record="), recordPath);
+	FParse::Value(*params, TEXT("replay="), replayPath);
+	bBatchInsert = FParse::Param(*params, TEXT("batchinsert"));
+	WorldBounds = FBox(FVector(-extent), FVector(extent));
+
+	TArray<ETreeType> treeTypes;
+	const UEnum* treeTypeEnum = StaticEnum<ETreeType>();
+	if (types.IsEmpty())
+	{
+		// the last entry is the generated _MAX
+		for (int32 i = 0; i < treeTypeEnum->NumEnums() - 1; ++i)
+		{
+			treeTypes.Add(ETreeType(treeTypeEnum->GetValueByIndex(i)));
+		}
+	}
+	else
+	{
+		TArray<FString> names;
+		types.ParseIntoArray(names, TEXT(","));
+		for (const FString& name : names)
+		{
+			const int64 value = treeTypeEnum->GetValueByNameString(name);
+			if (value == INDEX_NONE)
+			{
+				UE_LOG(LogTemp, Error, TEXT("GradworkBenchmark: unknown tree type %s"), *name);
+				return 1;
+			}
+			treeTypes.Add(ETreeType(value));
+		}
+	}
+	EBenchmarkDistribution distribution = EBenchmarkDistribution::Uniform;
+	if (distributionName == GetDistributionName(EBenchmarkDistribution::Clustered))
+	{
+		distribution = EBenchmarkDistribution::Clustered;
+	}
+	else if (distributionName == GetDistributionName(EBenchmarkDistribution::Planar))
+	{
+		distribution = EBenchmarkDistribution::Planar;
+	}
+
+	UWorld* world = UWorld::CreateWorld(EWorldType::Game, false, TEXT("GradworkBenchmark"));
+	FWorldContext& worldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+	worldContext.SetCurrentWorld(world);
+
+	int32 exitCode = 0;
+	if (!replayPath.IsEmpty())
+	{
+		exitCode = RunReplay(world, treeTypes, replayPath, outPath);
+	}
+	else if (FParse::Param(*params, TEXT("sweep")))
+	{
+		exitCode = RunSweep(world, treeTypes, params, outPath);
+	}
+	else
+	{
+		FTrajectoryWriter writer;
+		if (!recordPath.IsEmpty() && writer.Open(recordPath, NumAgents, WorldBounds))
+		{
+			Recorder = &writer;
+		}
+		exitCode = RunComparison(world, treeTypes, distribution, outPath);
+		Recorder = nullptr;
+	}
+
+	GEngine->DestroyWorldContext(world);
+	world->DestroyWorld(false);
+	return exitCode;
+}
+
+int32 UGradworkBenchmarkCommandlet::RunComparison(UWorld* world, TArrayView<const ETreeType> treeTypes, EBenchmarkDistribution distribution, const FString& outPath)
+{
+	PrepareAgents(world, NumAgents, distribution);
+	FString csv = CsvHeader;
+	for (ETreeType treeType : treeTypes)
+	{
+		const FGradworkBenchmarkResult result = RunTreeType(world, treeType, FGradworkBenchmarkConfig());
+		// one recorded run is enough, the others move the same way
+		if (Recorder)
+		{
+			Recorder->Close();
+			Recorder = nullptr;
+		}
+		UE_LOG(LogTemp, Display, TEXT("GradworkBenchmark %s: build %f ms, insert %f ms, update %f ms, query %f ms, steer %f ms per step, %d nodes, %f neighbours"),
+			*StaticEnum<ETreeType>()->GetNameStringByValue(int64(treeType)), result.Build.GetMeanMs(), result.Insert.GetMeanMs(), result.Update.GetMeanMs(),
+			result.Query.GetMeanMs(), result.Steer.GetMeanMs(), result.NodeCount, result.AverageNeighbours);
+		LogPhases(result);
+		csv += FormatRow(GetDistributionName(distribution), NumAgents, result);
+	}
+
+	if (!FFileHelper::SaveStringToFile(csv, *outPath))
+	{
+		UE_LOG(LogTemp, Error, TEXT("GradworkBenchmark: could not write %s"), *outPath);
+		return 1;
+	}
+	UE_LOG(LogTemp, Display, TEXT("GradworkBenchmark: wrote %s"), *outPath);
+	return 0;
+}
+
+int32 UGradworkBenchmarkCommandlet::RunReplay(UWorld* world, TArrayView<const ETreeType> treeTypes, const FString& replayPath, const FString& outPath)
+{
+	FTrajectoryReader reader;
+	if (!reader.Open(replayPath) || reader.GetNumFrames() == 0)
+	{
+		return 1;
+	}
+	// the recording decides the agents, the bounds and how many steps there are
+	WorldBounds = reader.GetBounds();
+	NumSteps = reader.GetNumFrames() - 1;
+	SpawnAgents(world, reader.GetNumAgents());
+	const TArrayView<const FVector3f> firstFrame = reader.GetFrame(0);
+	StartPositions.Reset();
+	StartPositions.Append(firstFrame.GetData(), firstFrame.Num());
+	StartDirections.Init(FVector3f::ZeroVector, NumAgents);
+	Replay = &reader;
+
+	const FString scenario = FPaths::GetCleanFilename(replayPath);
+	FString csv = CsvHeader;
+	for (ETreeType treeType : treeTypes)
+	{
+		const FGradworkBenchmarkResult result = RunTreeType(world, treeType, FGradworkBenchmarkConfig());
+		UE_LOG(LogTemp, Display, TEXT("GradworkBenchmark replay %s: build %f ms, insert %f ms, update %f ms, query %f ms per frame, %d nodes, %f neighbours"),
+			*StaticEnum<ETreeType>()->GetNameStringByValue(int64(treeType)), result.Build.GetMeanMs(), result.Insert.GetMeanMs(), result.Update.GetMeanMs(),
+			result.Query.GetMeanMs(), result.NodeCount, result.AverageNeighbours);
+		LogPhases(result);
+		csv += FormatRow(scenario, NumAgents, result);
+	}
+	Replay = nullptr;
+
+	if (!FFileHelper::SaveStringToFile(csv, *outPath))
+	{
+		UE_LOG(LogTemp, Error, TEXT("GradworkBenchmark: could not write %s"), *outPath);
+		return 1;
+	}
+	UE_LOG(LogTemp, Display, TEXT("GradworkBenchmark: wrote %s"), *outPath);
+	return 0;
+}
+
+int32 UGradworkBenchmarkCommandlet::RunSweep(UWorld* world, TArrayView<const ETreeType> treeTypes, const FString& params, const FString& outPath)
+{
+	const TArray<int32> counts = ParseIntList(params, TEXT("counts="), { 1000, 5000, 20000, 50000, 100000, 200000 });
+	const EBenchmarkDistribution distributions[] = { EBenchmarkDistribution::Uniform, EBenchmarkDistribution::Clustered, EBenchmarkDistribution::Planar };
+
+	FString csv = CsvHeader;
+	// per scenario the fastest configuration of every structure, in agent count order these are the scaling curves
+	FString bestCsv = FString(TEXT("FastestOverall,")) + CsvHeader;
+	for (EBenchmarkDistribution distribution : distributions)
+	{
+		for (int32 count : counts)
+		{
+			PrepareAgents(world, count, distribution);
+			TArray<FGradworkBenchmarkResult> bestPerType;
+			for (ETreeType treeType : treeTypes)
+			{
+				if (treeType == ETreeType::none && count > MaxBruteForceAgents)
+				{
+					continue;
+				}
+				FGradworkBenchmarkResult best;
+				for (const FGradworkBenchmarkConfig& config : GetSweepConfigs(treeType))
+				{
+					const FGradworkBenchmarkResult result = RunTreeType(world, treeType, config);
+					csv += FormatRow(GetDistributionName(distribution), count, result);
+					if (best.GetStepTime() == 0.0 || result.GetStepTime() < best.GetStepTime())
+					{
+						best = result;
+					}
+				}
+				bestPerType.Add(best);
+			}
+			if (bestPerType.IsEmpty())
+			{
+				continue;
+			}
+			const FGradworkBenchmarkResult* fastest = &bestPerType[0];
+			for (const FGradworkBenchmarkResult& best : bestPerType)
+			{
+				fastest = best.GetStepTime() < fastest->GetStepTime() ? &best : fastest;
+			}
+			for (const FGradworkBenchmarkResult& best : bestPerType)
+			{
+				bestCsv += (&best == fastest ? TEXT("1,") : TEXT("0,")) + FormatRow(GetDistributionName(distribution), count, best);
+			}
+			UE_LOG(LogTemp, Display, TEXT("GradworkBenchmark sweep %s %d agents: fastest is %s depth %d, %d per node, cell %f at %f ms per step, %f bytes per agent"),
+				GetDistributionName(distribution), count, *StaticEnum<ETreeType>()->GetNameStringByValue(int64(fastest->TreeType)),
+				fastest->Config.MaxDepth, fastest->Config.MaxActorsPerNode, fastest->Config.CellSize, fastest->GetStepTime(), fastest->BytesPerAgent);
+		}
+	}
+
+	const FString bestPath = FPaths::GetBaseFilename(outPath, false) + TEXT("_Best.csv");
+	if (!FFileHelper::SaveStringToFile(csv, *outPath) || !FFileHelper::SaveStringToFile(bestCsv, *bestPath))
+	{
+		UE_LOG(LogTemp, Error, TEXT("GradworkBenchmark: could not write %s"), *outPath);
+		return 1;
+	}
+	UE_LOG(LogTemp, Display, TEXT("GradworkBenchmark: wrote %s and %s"), *outPath, *bestPath);
+	return 0;
+}
+
+TArray<FGradworkBenchmarkConfig> UGradworkBenchmarkCommandlet::GetSweepConfigs(ETreeType treeType) const
+{
+	TArray<FGradworkBenchmarkConfig> configs;
+	switch (treeType)
+	{
+	case ETreeType::quadtree:
+	case ETreeType::octree:
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+		for (int32 maxDepth : { 4, 6, 8, 10, 12 })
+		{
+			for (int32 maxActorsPerNode : { 4, 8, 16, 32 })
+			{
+				FGradworkBenchmarkConfig& config = configs.AddDefaulted_GetRef();
+				config.MaxDepth = maxDepth;
+				config.MaxActorsPerNode = maxActorsPerNode;
+			}
+		}
+		break;
+	case ETreeType::hashgrid:
+		// around the query radius, smaller cells mean more cells per query and bigger ones more candidates per cell
+		for (float scale : { 0.5f, 1.f, 2.f })
+		{
+			configs.AddDefaulted_GetRef().CellSize = QueryRadius * scale;
+		}
+		break;
+	default:
+		configs.AddDefaulted();
+		break;
+	}
+	return configs;
+}
+
+void UGradworkBenchmarkCommandlet::SpawnAgents(UWorld* world, int32 numAgents)
+{
+	NumAgents = numAgents;
+	while (Agents.Num() < NumAgents)
+	{
+		AActor* agent = SpawnAgent(world, WorldBounds.GetCenter());
+		AgentIndices.Add(agent, Agents.Add(agent));
+	}
+}
+
+void UGradworkBenchmarkCommandlet::PrepareAgents(UWorld* world, int32 numAgents, EBenchmarkDistribution distribution)
+{
+	SpawnAgents(world, numAgents);
+
+	// every structure and every agent count starts from the same stream
+	FRandomStream stream(Seed);
+	TArray<FVector3f, TInlineAllocator<ClusterCount>> clusterCentres;
+	for (int32 i = 0; i < ClusterCount; ++i)
+	{
+		clusterCentres.Add(RandomPoint(stream, WorldBounds.ExpandBy(-WorldBounds.GetExtent().X * 0.2)));
+	}
+	const float clusterSize = WorldBounds.GetExtent().X * 0.05f;
+	const FVector3f min = FVector3f(WorldBounds.Min) + FVector3f(1.f);
+	const FVector3f max = FVector3f(WorldBounds.Max) - FVector3f(1.f);
+	StartPositions.Reset();
+	StartDirections.Reset();
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		FVector3f position = RandomPoint(stream, WorldBounds);
+		switch (distribution)
+		{
+		case EBenchmarkDistribution::Clustered:
+		{
+			const FVector3f& centre = clusterCentres[stream.RandHelper(ClusterCount)];
+			position = centre + FVector3f(RandomGaussian(stream), RandomGaussian(stream), RandomGaussian(stream)) * clusterSize;
+			break;
+		}
+		case EBenchmarkDistribution::Planar:
+			position.Z = WorldBounds.GetCenter().Z + stream.FRandRange(-PlanarThickness, PlanarThickness) * 0.5f;
+			break;
+		default:
+			break;
+		}
+		StartPositions.Add(FVector3f(FMath::Clamp(position.X, min.X, max.X), FMath::Clamp(position.Y, min.Y, max.Y), FMath::Clamp(position.Z, min.Z, max.Z)));
+		StartDirections.Add(FVector3f(stream.RandHelper(2) ? 1 : -1, stream.RandHelper(2) ? 1 : -1, stream.RandHelper(2) ? 1 : -1));
+	}
+}
+
+FGradworkBenchmarkResult UGradworkBenchmarkCommandlet::RunTreeType(UWorld* world, ETreeType treeType, const FGradworkBenchmarkConfig& config)
+{
+	FGradworkBenchmarkResult result;
+	result.TreeType = treeType;
+	result.Config = config;
+	Positions = StartPositions;
+	Directions = StartDirections;
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		Agents[i]->SetActorLocation(FVector(Positions[i]), false);
+	}
+	Neighbours.SetNum(NumAgents);
+	TotalNeighbours = 0;
+	FRandomStream stream(Seed);
+	if (Recorder)
+	{
+		Recorder->AddFrame(Positions);
+	}
+	const bool bHasNodeLimits = config.MaxDepth != INDEX_NONE && config.MaxActorsPerNode != INDEX_NONE;
+
+	// spawning is engine work, only what the structure does to get ready lands in the build time
+	AActor* structure = nullptr;
+	switch (treeType)
+	{
+	case ETreeType::quadtree:
+		structure = world->SpawnActor<AQuadTree>();
+		break;
+	case ETreeType::octree:
+		structure = world->SpawnActor<AOctree>();
+		break;
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+	{
+		ALinearTree* linearTree = world->SpawnActor<ALinearTree>();
+		linearTree->bPlanar = treeType == ETreeType::linearquadtree;
+		structure = linearTree;
+		break;
+	}
+	case ETreeType::hashgrid:
+		structure = world->SpawnActor<ASpatialHashGrid>();
+		break;
+	default:
+		break;
+	}
+	{
+		FScopedLatency buildLatency(&result.Build);
+		switch (treeType)
+		{
+		case ETreeType::quadtree:
+		{
+			AQuadTree* quadTree = Cast<AQuadTree>(structure);
+			if (bHasNodeLimits)
+			{
+				quadTree->SetNodeLimits(config.MaxDepth, config.MaxActorsPerNode);
+			}
+			quadTree->Build(WorldBounds);
+			break;
+		}
+		case ETreeType::octree:
+		{
+			AOctree* octree = Cast<AOctree>(structure);
+			if (bHasNodeLimits)
+			{
+				octree->SetNodeLimits(config.MaxDepth, config.MaxActorsPerNode);
+			}
+			octree->Build(WorldBounds);
+			break;
+		}
+		case ETreeType::linearoctree:
+		case ETreeType::linearquadtree:
+		{
+			ALinearTree* linearTree = Cast<ALinearTree>(structure);
+			if (bHasNodeLimits)
+			{
+				linearTree->SetNodeLimits(config.MaxDepth, config.MaxActorsPerNode);
+			}
+			linearTree->Build(WorldBounds);
+			break;
+		}
+		case ETreeType::hashgrid:
+		{
+			ASpatialHashGrid* hashGrid = Cast<ASpatialHashGrid>(structure);
+			if (config.CellSize > 0.f)
+			{
+				hashGrid->CellSize = config.CellSize;
+			}
+			hashGrid->Build(WorldBounds);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	const TArrayView<AActor* const> agents = MakeArrayView(Agents.GetData(), NumAgents);
+	{
+		FScopedLatency insertLatency(&result.Insert);
+		if (bBatchInsert && treeType == ETreeType::quadtree)
+		{
+			Cast<AQuadTree>(structure)->InsertBatch(agents);
+		}
+		else if (bBatchInsert && treeType == ETreeType::octree)
+		{
+			Cast<AOctree>(structure)->InsertBatch(agents);
+		}
+		else
+		{
+			for (int32 i = 0; i < NumAgents; ++i)
+			{
+				switch (treeType)
+				{
+				case ETreeType::quadtree:
+					Cast<AQuadTree>(structure)->Insert(Agents[i]);
+					break;
+				case ETreeType::octree:
+					Cast<AOctree>(structure)->Insert(Agents[i]);
+					break;
+				case ETreeType::linearoctree:
+				case ETreeType::linearquadtree:
+					Cast<ALinearTree>(structure)->Insert(Agents[i]);
+					break;
+				case ETreeType::hashgrid:
+					Cast<ASpatialHashGrid>(structure)->Insert(Agents[i]);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+	}
+
+	for (int32 step = 0; step < NumSteps; ++step)
+	{
+		// same per frame work the structures do in their own tick
+		{
+			GRADWORK_SCOPE_LATENCY(STAT_GradworkStepUpdate, &result.Update);
+			switch (treeType)
+			{
+			case ETreeType::quadtree:
+				Cast<AQuadTree>(structure)->UpdateAll();
+				break;
+			case ETreeType::octree:
+				Cast<AOctree>(structure)->UpdateAll();
+				break;
+			case ETreeType::linearoctree:
+			case ETreeType::linearquadtree:
+				Cast<ALinearTree>(structure)->Rebuild();
+				break;
+			case ETreeType::hashgrid:
+				Cast<ASpatialHashGrid>(structure)->UpdateAll();
+				break;
+			default:
+				break;
+			}
+		}
+		{
+			GRADWORK_SCOPE_LATENCY(STAT_GradworkStepQuery, &result.Query);
+			QueryAll(treeType, structure);
+		}
+		if (Replay)
+		{
+			// not timed, the replay stands in for the steering
+			AdvanceReplay(step + 1);
+		}
+		else
+		{
+			// not timed, the map lookups belong to the harness and not to the steering
+			ResolveNeighbours();
+			GRADWORK_SCOPE_LATENCY(STAT_GradworkStepSteer, &result.Steer);
+			SteerAll(stream);
+		}
+	}
+	if (NumSteps > 0 && NumAgents > 0)
+	{
+		result.AverageNeighbours = double(TotalNeighbours) / (double(NumSteps) * NumAgents);
+	}
+	result.NodeCount = CountNodes(treeType, structure);
+	if (NumAgents > 0)
+	{
+		result.BytesPerAgent = double(GetAllocatedSize(treeType, structure)) / NumAgents;
+	}
+
+	if (structure)
+	{
+		structure->Destroy();
+	}
+	return result;
+}
+
+void UGradworkBenchmarkCommandlet::QueryAll(ETreeType treeType, AActor* structure)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UGradworkBenchmarkCommandlet_QueryAll)
+	const float radiusSquared = QueryRadius * QueryRadius;
+	// the same one query per agent the agents do in QueryTree
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		TArray<AActor*>& out = Neighbours[i];
+		out.Reset();
+		const FVector location(Positions[i]);
+		switch (treeType)
+		{
+		case ETreeType::none:
+			// no structure, everyone tests everyone
+			for (int32 other = 0; other < NumAgents; ++other)
+			{
+				if (other != i && FVector3f::DistSquared(Positions[other], Positions[i]) <= radiusSquared)
+				{
+					out.Add(Agents[other]);
+				}
+			}
+			break;
+		case ETreeType::quadtree:
+			Cast<AQuadTree>(structure)->QueryCircle(location, QueryRadius, out, Agents[i]);
+			break;
+		case ETreeType::octree:
+			Cast<AOctree>(structure)->QuerySphere(location, QueryRadius, out, Agents[i]);
+			break;
+		case ETreeType::linearoctree:
+		case ETreeType::linearquadtree:
+			Cast<ALinearTree>(structure)->QuerySphere(location, QueryRadius, out, Agents[i]);
+			break;
+		case ETreeType::hashgrid:
+			Cast<ASpatialHashGrid>(structure)->QuerySphere(location, QueryRadius, out, Agents[i]);
+			break;
+		default:
+			break;
+		}
+		TotalNeighbours += out.Num();
+	}
+}
+
+void UGradworkBenchmarkCommandlet::ResolveNeighbours()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UGradworkBenchmarkCommandlet_ResolveNeighbours)
+	NeighbourIndices.SetNum(NumAgents);
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		NeighbourIndices[i].Reset();
+		for (AActor* neighbour : Neighbours[i])
+		{
+			NeighbourIndices[i].Add(AgentIndices.FindChecked(neighbour));
+		}
+	}
+}
+
+void UGradworkBenchmarkCommandlet::SteerAll(FRandomStream& stream)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UGradworkBenchmarkCommandlet_SteerAll)
+	NextPositions.SetNumUninitialized(NumAgents);
+	NextDirections.SetNumUninitialized(NumAgents);
+	Steering::FNeighbourData packed;
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		packed.Reset();
+		for (const int32 neighbourIndex : NeighbourIndices[i])
+		{
+			packed.Add(Positions[neighbourIndex], Directions[neighbourIndex] * AgentSpeed);
+		}
+		const Steering::FNeighbourSums sums = Steering::Accumulate(packed, Positions[i], QueryRadius);
+		const FVector3f flockingVector = Steering::Blend(sums, Positions[i], SeparationWeight, AlignmentWeight, CohesionWeight);
+		FVector3f finalDirection = Directions[i] + flockingVector * 5.f;
+		finalDirection.Normalize();
+		NextPositions[i] = Positions[i] + finalDirection * AgentSpeed * StepTime;
+		NextDirections[i] = Directions[i];
+		if (!WorldBounds.IsInside(FVector(NextPositions[i])))
+		{
+			NextPositions[i] = RandomPoint(stream, WorldBounds);
+			NextDirections[i] = FVector3f(stream.RandHelper(2) ? 1 : -1, stream.RandHelper(2) ? 1 : -1, stream.RandHelper(2) ? 1 : -1);
+		}
+	}
+	Swap(Positions, NextPositions);
+	Swap(Directions, NextDirections);
+	// the structures read the actor transforms in their update, like they do in game
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		Agents[i]->SetActorLocation(FVector(Positions[i]), false);
+	}
+	if (Recorder)
+	{
+		Recorder->AddFrame(Positions);
+	}
+}
+
+void UGradworkBenchmarkCommandlet::AdvanceReplay(int32 frame)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(UGradworkBenchmarkCommandlet_AdvanceReplay)
+	const TArrayView<const FVector3f> positions = Replay->GetFrame(frame);
+	Positions.Reset();
+	Positions.Append(positions.GetData(), positions.Num());
+	for (int32 i = 0; i < NumAgents; ++i)
+	{
+		Agents[i]->SetActorLocation(FVector(Positions[i]), false);
+	}
+}
+
+int32 UGradworkBenchmarkCommandlet::CountNodes(ETreeType treeType, AActor* structure) const
+{
+	int32 count = 0;
+	switch (treeType)
+	{
+	case ETreeType::quadtree:
+		for (const FQuadTreeNode& node : Cast<AQuadTree>(structure)->GetNodes())
+		{
+			count += node.bInUse ? 1 : 0;
+		}
+		break;
+	case ETreeType::octree:
+		for (const FOctreeNode& node : Cast<AOctree>(structure)->GetNodes())
+		{
+			count += node.bInUse ? 1 : 0;
+		}
+		break;
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+		count = Cast<ALinearTree>(structure)->GetNumNodes();
+		break;
+	case ETreeType::hashgrid:
+		count = Cast<ASpatialHashGrid>(structure)->GetNumCells();
+		break;
+	default:
+		break;
+	}
+	return count;
+}
+
+SIZE_T UGradworkBenchmarkCommandlet::GetAllocatedSize(ETreeType treeType, AActor* structure) const
+{
+	switch (treeType)
+	{
+	case ETreeType::quadtree:
+		return Cast<AQuadTree>(structure)->GetAllocatedSize();
+	case ETreeType::octree:
+		return Cast<AOctree>(structure)->GetAllocatedSize();
+	case ETreeType::linearoctree:
+	case ETreeType::linearquadtree:
+		return Cast<ALinearTree>(structure)->GetAllocatedSize();
+	case ETreeType::hashgrid:
+		return Cast<ASpatialHashGrid>(structure)->GetAllocatedSize();
+	default:
+		return 0;
+	}
+}
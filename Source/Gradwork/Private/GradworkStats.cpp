@@ -0,0 +1,161 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "GradworkStats.h"
+#include "EngineUtils.h"
+#include "HAL/IConsoleManager.h"
+#include "Octree.h"
+#include "QuadTree.h"
+
+DEFINE_STAT(STAT_GradworkQuery);
+DEFINE_STAT(STAT_GradworkQueryBatch);
+DEFINE_STAT(STAT_GradworkInsert);
+DEFINE_STAT(STAT_GradworkRemove);
+DEFINE_STAT(STAT_GradworkUpdate);
+DEFINE_STAT(STAT_GradworkSubdivide);
+DEFINE_STAT(STAT_GradworkCollapse);
+DEFINE_STAT(STAT_GradworkStepUpdate);
+DEFINE_STAT(STAT_GradworkStepQuery);
+DEFINE_STAT(STAT_GradworkStepSteer);
+DEFINE_STAT(STAT_GradworkStepTransform);
+
+CSV_DEFINE_CATEGORY_MODULE(GRADWORK_API, Gradwork, true);
+
+uint64 FLatencyHistogram::GetBucketValue(int32 bucket)
+{
+	if (bucket < LinearCount)
+	{
+		return uint64(bucket);
+	}
+	const int32 exponent = (bucket - LinearCount) / SubBucketCount + SubBucketBits + 1;
+	const int32 shift = exponent - SubBucketBits;
+	const uint64 lower = uint64((bucket - LinearCount) % SubBucketCount + SubBucketCount) << shift;
+	return lower + ((uint64(1) << shift) >> 1);
+}
+
+uint64 FLatencyHistogram::GetPercentile(double percentile) const
+{
+	if (Count == 0)
+	{
+		return 0;
+	}
+	const uint64 target = FMath::Max<uint64>(1, uint64(FMath::CeilToDouble(percentile / 100.0 * double(Count))));
+	uint64 seen = 0;
+	for (int32 i = 0; i < BucketCount; ++i)
+	{
+		seen += Counts[i];
+		if (seen >= target)
+		{
+			// the bucket middle can overshoot the largest sample that landed in it
+			return FMath::Min(GetBucketValue(i), MaxCycles);
+		}
+	}
+	return MaxCycles;
+}
+
+void FLatencyHistogram::Reset()
+{
+	FMemory::Memzero(Counts, sizeof(Counts));
+	Count = 0;
+	TotalCycles = 0;
+	MaxCycles = 0;
+	ResetFrame();
+}
+
+void FLatencyHistogram::Log(const TCHAR* owner, const TCHAR* operation) const
+{
+	if (Count == 0)
+	{
+		return;
+	}
+	UE_LOG(LogTemp, Log, TEXT("%s %s: %llu samples, mean %f ms, p50 %f ms, p95 %f ms, p99 %f ms, max %f ms"),
+		owner, operation, Count, GetMeanMs(), GetPercentileMs(50.0), GetPercentileMs(95.0), GetPercentileMs(99.0), GetMaxMs());
+}
+
+void FGradworkLatencyStats::Log(const TCHAR* owner) const
+{
+	Query.Log(owner, TEXT("Query"));
+	QueryBatch.Log(owner, TEXT("QueryBatch"));
+	Insert.Log(owner, TEXT("Insert"));
+	Remove.Log(owner, TEXT("Remove"));
+	Update.Log(owner, TEXT("Update"));
+	Subdivide.Log(owner, TEXT("Subdivide"));
+	Collapse.Log(owner, TEXT("Collapse"));
+}
+
+void FGradworkLatencyStats::PublishFrame()
+{
+	// accumulated rather than set, so several structures in one world add up
+#define GRADWORK_CSV_HISTOGRAM(Name) \
+	CSV_CUSTOM_STAT(Gradwork, Name##Count, int32(Name.FrameCount), ECsvCustomStatOp::Accumulate); \
+	CSV_CUSTOM_STAT(Gradwork, Name##Ms, float(FPlatformTime::ToMilliseconds64(Name.FrameCycles)), ECsvCustomStatOp::Accumulate); \
+	CSV_CUSTOM_STAT(Gradwork, Name##MaxMs, float(FPlatformTime::ToMilliseconds64(Name.FrameMaxCycles)), ECsvCustomStatOp::Max); \
+	Name.ResetFrame();
+
+	GRADWORK_CSV_HISTOGRAM(Query)
+	GRADWORK_CSV_HISTOGRAM(QueryBatch)
+	GRADWORK_CSV_HISTOGRAM(Insert)
+	GRADWORK_CSV_HISTOGRAM(Remove)
+	GRADWORK_CSV_HISTOGRAM(Update)
+	GRADWORK_CSV_HISTOGRAM(Subdivide)
+	GRADWORK_CSV_HISTOGRAM(Collapse)
+#undef GRADWORK_CSV_HISTOGRAM
+}
+
+void FGradworkLatencyStats::Reset()
+{
+	Query.Reset();
+	QueryBatch.Reset();
+	Insert.Reset();
+	Remove.Reset();
+	Update.Reset();
+	Subdivide.Reset();
+	Collapse.Reset();
+}
+
+void FSpatialTreeStats::Log(const TCHAR* owner) const
+{
+	// "index:count" for every bucket that isn't empty
+	auto formatHistogram = [](const TArray<int32>& histogram)
+	{
+		FString text;
+		for (int32 i = 0; i < histogram.Num(); ++i)
+		{
+			if (histogram[i] > 0)
+			{
+				text += FString::Printf(TEXT(" %d:%d"), i, histogram[i]);
+			}
+		}
+		return text;
+	};
+	UE_LOG(LogTemp, Log, TEXT("%s: %d nodes in use of %d pooled (%d free blocks), %d leaves, %d empty, %d over capacity at max depth %d, %d one level up"),
+		owner, NodeCount, PooledNodeCount, FreeBlockCount, LeafCount, EmptyLeafCount, OverCapacityLeafCount, MaxDepth, OverCapacityParentCount);
+	UE_LOG(LogTemp, Log, TEXT("%s: %d elements, %d in interior nodes, %d per node before a split"),
+		owner, ElementCount, InteriorElementCount, MaxElementsPerNode);
+	UE_LOG(LogTemp, Log, TEXT("%s: %llu bytes allocated, %llu of them slack, %llu held by recycled nodes"),
+		owner, uint64(AllocatedBytes), uint64(SlackBytes), uint64(RecycledBytes));
+	UE_LOG(LogTemp, Log, TEXT("%s nodes per depth:%s"), owner, *formatHistogram(DepthHistogram));
+	UE_LOG(LogTemp, Log, TEXT("%s leaves per element count:%s"), owner, *formatHistogram(LeafOccupancyHistogram));
+	UE_LOG(LogTemp, Log, TEXT("%s leaves at max depth per element count:%s"), owner, *formatHistogram(MaxDepthOccupancyHistogram));
+}
+
+static void DumpTrees(UWorld* world)
+{
+	if (!world)
+	{
+		return;
+	}
+	for (TActorIterator<AQuadTree> it(world); it; ++it)
+	{
+		it->GetTreeStats().Log(*it->GetName());
+	}
+	for (TActorIterator<AOctree> it(world); it; ++it)
+	{
+		it->GetTreeStats().Log(*it->GetName());
+	}
+}
+
+static FAutoConsoleCommandWithWorld DumpTreeCommand(
+	TEXT("Gradwork.DumpTree"),
+	TEXT("Logs node counts, depth and occupancy histograms and memory use of every quadtree and octree in the world"),
+	FConsoleCommandWithWorldDelegate::CreateStatic(&DumpTrees));
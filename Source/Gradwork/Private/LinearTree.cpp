@@ -0,0 +1,365 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "LinearTree.h"
+#include "DrawDebugHelpers.h"
+
+// spreads the lower 21 bits of value so there are two zero bits between each of them
+static uint64 SplitBy3(uint32 value)
+{
+	uint64 x = value & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffff;
+	x = (x | x << 16) & 0x1f0000ff0000ff;
+	x = (x | x << 8) & 0x100f00f00f00f00f;
+	x = (x | x << 4) & 0x10c30c30c30c30c3;
+	x = (x | x << 2) & 0x1249249249249249;
+	return x;
+}
+
+// spreads the 32 bits of value so there is one zero bit between each of them
+static uint64 SplitBy2(uint32 value)
+{
+	uint64 x = value;
+	x = (x | x << 16) & 0x0000ffff0000ffff;
+	x = (x | x << 8) & 0x00ff00ff00ff00ff;
+	x = (x | x << 4) & 0x0f0f0f0f0f0f0f0f;
+	x = (x | x << 2) & 0x3333333333333333;
+	x = (x | x << 1) & 0x5555555555555555;
+	return x;
+}
+
+// Sets default values
+ALinearTree::ALinearTree()
+{
+	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+	// agents add this actor as a tick prerequisite so they always query this frame's rebuild
+	PrimaryActorTick.TickGroup = TG_PrePhysics;
+}
+
+// Called when the game starts or when spawned
+void ALinearTree::BeginPlay()
+{
+	Super::BeginPlay();
+
+}
+
+void ALinearTree::EndPlay(EEndPlayReason::Type reason)
+{
+	Super::EndPlay(reason);
+
+	Latency.Log(TEXT("LINEAR TREE"));
+}
+
+bool ALinearTree::IsInsideBounds(AActor* actor)
+{
+	return WorldBounds.IsInside(actor->GetActorLocation());
+}
+
+void ALinearTree::Build(const FBox& bounds)
+{
+	if (!bIsBuilt)
+	{
+		WorldBounds = bounds;
+		Nodes.Reset();
+		bIsBuilt = true;
+	}
+}
+
+void ALinearTree::Insert(AActor* actor)
+{
+	if (actor && !ActorIndices.Contains(actor))
+	{
+		ActorIndices.Add(actor, allActors.Add(actor));
+	}
+}
+
+void ALinearTree::Remove(AActor* actor)
+{
+	int32 index = INDEX_NONE;
+	if (!ActorIndices.RemoveAndCopyValue(actor, index))
+	{
+		return;
+	}
+	allActors.RemoveAtSwap(index, 1, false);
+	if (allActors.IsValidIndex(index))
+	{
+		ActorIndices.Add(allActors[index], index);
+	}
+}
+
+SIZE_T ALinearTree::GetAllocatedSize() const
+{
+	return allActors.GetAllocatedSize() + ActorIndices.GetAllocatedSize() + Positions.GetAllocatedSize() + Entries.GetAllocatedSize() + SortScratch.GetAllocatedSize()
+		+ SortedActors.GetAllocatedSize() + SortedPositions.GetAllocatedSize() + Nodes.GetAllocatedSize();
+}
+
+int32 ALinearTree::GetLevelCount() const
+{
+	// the key only needs as many bits per axis as the tree can be deep
+	return FMath::Clamp(MaxDepth, 1, bPlanar ? 32 : 21);
+}
+
+void ALinearTree::Rebuild()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ALinearTree_Rebuild)
+	if (!bIsBuilt)
+	{
+		return;
+	}
+	// the rebuild is this structure's update, it lands in the same histogram as the trees' UpdateAll
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkUpdate, &Latency.Update);
+
+	// destroyed actors shift the rest, and blueprints can edit allActors directly
+	if (allActors.RemoveAll([](AActor* actor) { return !IsValid(actor); }) > 0 || ActorIndices.Num() != allActors.Num())
+	{
+		ActorIndices.Reset();
+		for (int32 i = 0; i < allActors.Num(); ++i)
+		{
+			ActorIndices.Add(allActors[i], i);
+		}
+	}
+	const int32 actorCount = allActors.Num();
+	Positions.SetNumUninitialized(actorCount);
+	Entries.SetNumUninitialized(actorCount);
+	for (int32 i = 0; i < actorCount; ++i)
+	{
+		Positions[i] = allActors[i]->GetActorLocation();
+		Entries[i].ActorIndex = i;
+		Entries[i].Key = ComputeKey(Positions[i]);
+	}
+	SortEntries();
+
+	SortedActors.SetNumUninitialized(actorCount);
+	SortedPositions.SetNumUninitialized(actorCount);
+	for (int32 i = 0; i < actorCount; ++i)
+	{
+		SortedActors[i] = allActors[Entries[i].ActorIndex];
+		SortedPositions[i] = Positions[Entries[i].ActorIndex];
+	}
+
+	Nodes.Reset();
+	FLinearTreeNode& root = Nodes.AddDefaulted_GetRef();
+	root.Bounds = WorldBounds;
+	root.Begin = 0;
+	root.End = actorCount;
+	BuildNode(0);
+}
+
+uint64 ALinearTree::ComputeKey(const FVector& location) const
+{
+	const uint64 cellCount = uint64(1) << GetLevelCount();
+	const FVector size = WorldBounds.GetSize();
+	auto quantize = [cellCount](double value, double min, double extent) -> uint32
+	{
+		const double t = extent > 0.0 ? (value - min) / extent : 0.0;
+		return uint32(FMath::Clamp<int64>(FMath::FloorToInt64(t * double(cellCount)), 0, int64(cellCount) - 1));
+	};
+	const uint32 x = quantize(location.X, WorldBounds.Min.X, size.X);
+	const uint32 y = quantize(location.Y, WorldBounds.Min.Y, size.Y);
+	if (bPlanar)
+	{
+		return SplitBy2(x) | SplitBy2(y) << 1;
+	}
+	const uint32 z = quantize(location.Z, WorldBounds.Min.Z, size.Z);
+	return SplitBy3(x) | SplitBy3(y) << 1 | SplitBy3(z) << 2;
+}
+
+void ALinearTree::SortEntries()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ALinearTree_SortEntries)
+	if (Entries.IsEmpty())
+	{
+		return;
+	}
+	// LSD radix sort, 8 bits per pass and only over the bits the key actually uses
+	const int32 keyBits = GetLevelCount() * GetDimensions();
+	SortScratch.SetNumUninitialized(Entries.Num());
+	for (int32 shift = 0; shift < keyBits; shift += 8)
+	{
+		int32 histogram[256] = {};
+		for (const FMortonEntry& entry : Entries)
+		{
+			++histogram[(entry.Key >> shift) & 0xff];
+		}
+		// every key has the same digit here, the pass would only copy
+		if (histogram[(Entries[0].Key >> shift) & 0xff] == Entries.Num())
+		{
+			continue;
+		}
+		int32 offset = 0;
+		for (int32& count : histogram)
+		{
+			const int32 bucketSize = count;
+			count = offset;
+			offset += bucketSize;
+		}
+		for (const FMortonEntry& entry : Entries)
+		{
+			SortScratch[histogram[(entry.Key >> shift) & 0xff]++] = entry;
+		}
+		Swap(Entries, SortScratch);
+	}
+}
+
+FBox ALinearTree::GetChildBounds(const FBox& bounds, uint64 digit) const
+{
+	// bit 0 of a Morton digit is X, bit 1 is Y and bit 2 is Z, a set bit selects the upper half
+	const FVector center = bounds.GetCenter();
+	FBox child = bounds;
+	(digit & 1 ? child.Min.X : child.Max.X) = center.X;
+	(digit & 2 ? child.Min.Y : child.Max.Y) = center.Y;
+	if (!bPlanar)
+	{
+		(digit & 4 ? child.Min.Z : child.Max.Z) = center.Z;
+	}
+	return child;
+}
+
+void ALinearTree::BuildNode(int32 nodeIndex)
+{
+	const int32 begin = Nodes[nodeIndex].Begin;
+	const int32 end = Nodes[nodeIndex].End;
+	const int32 depth = Nodes[nodeIndex].Depth;
+	const int32 levels = GetLevelCount();
+	if (end - begin <= MaxActorsPerNode || depth >= levels)
+	{
+		return;
+	}
+	const int32 dimensions = GetDimensions();
+	const int32 shift = (levels - 1 - depth) * dimensions;
+	const uint64 digitMask = (uint64(1) << dimensions) - 1;
+	const FBox bounds = Nodes[nodeIndex].Bounds;
+
+	// keys in the range share their prefix, so each child is one contiguous run of the same digit
+	const int32 firstChild = Nodes.Num();
+	int32 runBegin = begin;
+	while (runBegin < end)
+	{
+		const uint64 digit = (Entries[runBegin].Key >> shift) & digitMask;
+		int32 runEnd = runBegin + 1;
+		while (runEnd < end && ((Entries[runEnd].Key >> shift) & digitMask) == digit)
+		{
+			++runEnd;
+		}
+		FLinearTreeNode& child = Nodes.AddDefaulted_GetRef();
+		child.Bounds = GetChildBounds(bounds, digit);
+		child.Begin = runBegin;
+		child.End = runEnd;
+		child.Depth = depth + 1;
+		runBegin = runEnd;
+	}
+	const int32 childCount = Nodes.Num() - firstChild;
+	Nodes[nodeIndex].FirstChild = firstChild;
+	Nodes[nodeIndex].ChildCount = childCount;
+	for (int32 i = 0; i < childCount; ++i)
+	{
+		BuildNode(firstChild + i);
+	}
+}
+
+void ALinearTree::Query(const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ALinearTree_Query)
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+
+	// the faces of the world count as inside, the planar tree has no height to leave
+	const FVector location = bPlanar ? FVector(queryLocation.X, queryLocation.Y, WorldBounds.Min.Z) : queryLocation;
+	const bool bInWorld = WorldBounds.IsInsideOrOn(location);
+	int32 nodeIndex = Nodes.IsEmpty() || !bInWorld ? INDEX_NONE : 0;
+	// the location descends by the digits of its own key, so it ends in the leaf it would have been sorted into
+	const uint64 key = nodeIndex != INDEX_NONE ? ComputeKey(queryLocation) : 0;
+	const int32 levels = GetLevelCount();
+	const int32 dimensions = GetDimensions();
+	const uint64 digitMask = (uint64(1) << dimensions) - 1;
+	while (nodeIndex != INDEX_NONE && !Nodes[nodeIndex].IsLeaf())
+	{
+		const FLinearTreeNode& node = Nodes[nodeIndex];
+		const int32 shift = (levels - 1 - node.Depth) * dimensions;
+		const uint64 digit = (key >> shift) & digitMask;
+		nodeIndex = INDEX_NONE;
+		// empty octants are never created, so the location can fall into none of the children
+		for (int32 i = 0; i < node.ChildCount; ++i)
+		{
+			const FLinearTreeNode& child = Nodes[node.FirstChild + i];
+			if (((Entries[child.Begin].Key >> shift) & digitMask) == digit)
+			{
+				nodeIndex = node.FirstChild + i;
+				break;
+			}
+		}
+	}
+	if (nodeIndex != INDEX_NONE)
+	{
+		const FLinearTreeNode& leaf = Nodes[nodeIndex];
+		for (int32 i = leaf.Begin; i < leaf.End; ++i)
+		{
+			if (SortedActors[i] != queryInstigator)
+			{
+				outActors.AddUnique(SortedActors[i]);
+			}
+		}
+	}
+}
+
+void ALinearTree::QuerySphere(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ALinearTree_QuerySphere)
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+	if (!Nodes.IsEmpty())
+	{
+		QuerySphereNode(0, center, radius * radius, outActors, queryInstigator);
+	}
+}
+
+void ALinearTree::QuerySphereNode(int32 nodeIndex, const FVector& center, float radiusSquared, TArray<AActor*>& outActors, AActor* queryInstigator) const
+{
+	const FLinearTreeNode& node = Nodes[nodeIndex];
+	// planar nodes are only split on XY, so the distance to them is only measured there
+	const FVector nearest = bPlanar ? FVector(center.X, center.Y, node.Bounds.GetCenter().Z) : center;
+	if (node.Bounds.ComputeSquaredDistanceToPoint(nearest) > radiusSquared)
+	{
+		return;
+	}
+	if (!node.IsLeaf())
+	{
+		for (int32 i = 0; i < node.ChildCount; ++i)
+		{
+			QuerySphereNode(node.FirstChild + i, center, radiusSquared, outActors, queryInstigator);
+		}
+		return;
+	}
+	for (int32 i = node.Begin; i < node.End; ++i)
+	{
+		const FVector& position = SortedPositions[i];
+		const bool bInside = bPlanar
+			? FVector::DistSquared2D(position, center) <= radiusSquared && FMath::Abs(position.Z - center.Z) < zHeightTolerance
+			: FVector::DistSquared(position, center) <= radiusSquared;
+		if (bInside && SortedActors[i] != queryInstigator)
+		{
+			outActors.Add(SortedActors[i]);
+		}
+	}
+}
+
+void ALinearTree::VisualiseTree()
+{
+	if (!bvisualize) return;
+	for (const FLinearTreeNode& node : Nodes)
+	{
+		if (node.IsLeaf())
+		{
+			DrawDebugBox(GetWorld(), node.Bounds.GetCenter(),
+				node.Bounds.GetExtent(), FColor::Green, false, 0.1f, node.Depth, 2.f);
+		}
+	}
+}
+
+// Called every frame
+void ALinearTree::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+	Rebuild();
+	VisualiseTree();
+	Latency.PublishFrame();
+}
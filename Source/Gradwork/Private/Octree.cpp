@@ -8,7 +8,16 @@ AOctree::AOctree()
 {
 	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
 	PrimaryActorTick.bCanEverTick = true;
-
+	// agents add this actor as a tick prerequisite, UpdateAll has to run before any of them query
+	PrimaryActorTick.TickGroup = TG_PrePhysics;
+	// keeps the agent's cached leaf in sync with where the tree actually stored it
+	Core.SetOnLeafAssigned([](AActor* actor, int32 nodeIndex)
+	{
+		if (AAgent* agent = Cast<AAgent>(actor))
+		{
+			agent->octQueryResponder = nodeIndex;
+		}
+	});
 }
 
 bool AOctree::IsInsideBounds(AActor* actor)
@@ -25,335 +34,179 @@ void AOctree::BeginPlay()
 void AOctree::EndPlay(EEndPlayReason::Type reason)
 {
 	Super::EndPlay(reason);
+	Core.CancelAsyncRebuild();
 
-	if (QueryCount > 0)
-	{
-		double averageQueryTime = TotalQueryTime / double(QueryCount);
-		UE_LOG(LogTemp, Log, TEXT("Average OCTREE Query time: %f ms over %d queries"), averageQueryTime, QueryCount);
-	}
-	if (InsertCount > 0)
-	{
-		double averageInsertTime = TotalInsertTime / double(InsertCount);
-		UE_LOG(LogTemp, Log, TEXT("Average OCTREE Insert time: %f ms over %d inserts"), averageInsertTime, InsertCount);
-
-	}
+	Core.GetLatency().Log(TEXT("OCTREE"));
 }
 void AOctree::Build(const FBox& bounds)
 {
-	if (!bIsBuilt)
+	if (!Core.IsBuilt())
 	{
 		WorldBounds = bounds;
-		root = MakeShared<FOctreeNode>(WorldBounds);
-		bIsBuilt = true;
+		ApplySettings();
+		Core.Build(WorldBounds);
 	}
 }
 
-
-void AOctree::Subdivide(TSharedPtr<FOctreeNode> node)
+void AOctree::ApplySettings()
 {
-	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_Subdivide)
-
-	FBox bounds = node->Bounds;
-	FVector center = node->Bounds.GetCenter();
-
-	//https://www.gamedev.net/tutorials/programming/general-and-gameplay-programming/introduction-to-octrees-r3529/#:~:text=Initializing%20the%20enclosing%20region,objects%20in%20the%20game%20world.
-	FBox octant0 = FBox(bounds.Min, center);
-	FBox octant1 = FBox(FVector(center.X, bounds.Min.Y, bounds.Min.Z), FVector(bounds.Max.X, center.Y, center.Z));
-	FBox octant2 = FBox(FVector(center.X, bounds.Min.Y, center.Z), FVector(bounds.Max.X, center.Y, bounds.Max.Z));
-	FBox octant3 = FBox(FVector(bounds.Min.X, bounds.Min.Y, center.Z), FVector(center.X, center.Y, bounds.Max.Z));
-	FBox octant4 = FBox(FVector(bounds.Min.X, center.Y, bounds.Min.Z), FVector(center.X, bounds.Max.Y, center.Z));
-	FBox octant5 = FBox(FVector(center.X, center.Y, bounds.Min.Z), FVector(bounds.Max.X, bounds.Max.Y, center.Z));
-	FBox octant6 = FBox(center, bounds.Max);
-	FBox octant7 = FBox(FVector(bounds.Min.X, center.Y, center.Z), FVector(center.X, bounds.Max.Y, bounds.Max.Z));
-	node->Children.Empty();
-	node->Children.Add(MakeShared<FOctreeNode>(octant0));
-	node->Children.Add(MakeShared<FOctreeNode>(octant1));
-	node->Children.Add(MakeShared<FOctreeNode>(octant2));
-	node->Children.Add(MakeShared<FOctreeNode>(octant3));
-	node->Children.Add(MakeShared<FOctreeNode>(octant4));
-	node->Children.Add(MakeShared<FOctreeNode>(octant5));
-	node->Children.Add(MakeShared<FOctreeNode>(octant6));
-	node->Children.Add(MakeShared<FOctreeNode>(octant7));
-	for (auto& child : node->Children)
-	{
-		child->Parent = node;
-	}
-
-
+	Core.SetLimits(MaxDepth, MaxActorsPerNode, MergeRatio, MaintenanceInterval);
+	Core.bAsyncRebuild = bAsyncRebuild;
+	Core.bCoherentQueries = bCoherentQueries;
 }
+
 void AOctree::Insert(AActor* actor)
 {
 
 	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_Insert)
-	double startTime = FPlatformTime::Seconds() * 1000.f;
-	InsertNode(root, actor);
-	double endTime = FPlatformTime::Seconds() * 1000.f;
-	TotalInsertTime += endTime - startTime;
-	++InsertCount;
-}
-void AOctree::InsertNode(TSharedPtr<FOctreeNode>& node, AActor* actor)
-{
-	if (!actor || !node->Bounds.IsInside((actor->GetActorLocation())))
-	{
-		return;
-	}
-	if (!node->IsLeaf())
-	{
-		for (auto& child : node->Children)
-		{
-			InsertNode(child, actor);
-		}
-		return;
-	}
-	// if node doesnt have children and can insert new actors
-	if (node->IsLeaf() && node->Actors.Num() < MaxActorsPerNode)
+	if (actor)
 	{
-		node->Actors.AddUnique(actor);
-		return;
+		Core.Insert(actor, FVector3f(actor->GetActorLocation()));
 	}
+}
 
-
-	// if current node has no children
-	if (node->Depth < MaxDepth)
+void AOctree::InsertBatch(TArrayView<AActor* const> actors)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_InsertBatch)
+	TArray<AActor*> elements;
+	TArray<FVector3f> positions;
+	elements.Reserve(actors.Num());
+	positions.Reserve(actors.Num());
+	for (AActor* actor : actors)
 	{
-		Subdivide(node);
-		for (auto& child : node->Children)
+		if (actor)
 		{
-			child->Depth = node->Depth + 1;
-			//new actor to add
-			if (child->Bounds.IsInside(actor->GetActorLocation()))
-			{
-				InsertNode(child, actor);
-			}
-			// actor from parent
-			for (auto& parentActor : node->Actors)
-			{
-				if (child->Bounds.IsInside(parentActor->GetActorLocation()))
-				{
-					InsertNode(child, parentActor);
-				}
-			}
+			elements.Add(actor);
+			positions.Add(FVector3f(actor->GetActorLocation()));
 		}
-		node->Actors.Empty();
-		return;
 	}
-	// final depth has been reached + more than max amount agents per node, adding to node as a last resort
-	node->Actors.Add(actor);
-	return;
+	Core.InsertBatch(elements, positions);
 }
 
 void AOctree::Query(const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator)
 {
 	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_Query)
 
-	double startTime = FPlatformTime::Seconds() * 1000.f;
-	QueryNode(root, queryLocation, outActors, queryInstigator);
-	double endTime = FPlatformTime::Seconds() * 1000.f;
+	Core.QueryLeaf(FVector3f(queryLocation), outActors, queryInstigator, [](const FVector3f& position) { return true; });
+}
+
+void AOctree::QuerySphere(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_QuerySphere)
 
-	TotalQueryTime += endTime - startTime;
-	++QueryCount;
+	Core.QueryRadius(FVector3f(center), radius, outActors, queryInstigator);
 }
 
-void AOctree::QueryNode(TSharedPtr<FOctreeNode> node, const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator)
+void AOctree::QueryBox(const FBox& box, TArray<AActor*>& outActors, AActor* queryInstigator)
 {
-	//VisualiseNode(GetWorld(), node, FColor::Magenta);
-	if (!node->Bounds.IsInside(queryLocation))
-	{
-		//	VisualiseNode(GetWorld(), node, FColor::Red);
-		return;
-	}
-	//if node has kids
-	if (!node->IsLeaf())
-	{
-		//	VisualiseNode(GetWorld(), node, FColor::Magenta);
-		for (auto& child : node->Children)
-		{
-			QueryNode(child, queryLocation, outActors, queryInstigator);
-		}
-		return;
-	}
-	// if current node has no kids
-	for (AActor* actor : node->Actors)
-	{
-		if (node->Bounds.IsInside(actor->GetActorLocation()))
-		{
-			if (actor != queryInstigator)
-			{
-				outActors.AddUnique(actor);
-				AAgent* agent = Cast<AAgent>(outActors.Top());
-				agent->octQueryResponder = node;
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_QueryBox)
 
-			}
-		}
+	Core.QueryBox(box, outActors, queryInstigator);
+}
 
-	}
-	AAgent* agent = Cast<AAgent>(queryInstigator);
-	agent->octQueryResponder = node;
-	//VisualiseNode(GetWorld(), node, FColor::Blue);
+void AOctree::QueryKNearest(const FVector& location, int32 k, float maxRadius, TArray<AActor*>& outActors, AActor* queryInstigator)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_QueryKNearest)
+	Core.QueryKNearest(FVector3f(location), k, maxRadius, outActors, queryInstigator);
+}
 
-	return;
+void AOctree::QueryBatch(TArrayView<const FVector> locations, float radius, int32 k, FNeighbourBuffer& outNeighbours, TArrayView<AActor* const> instigators)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_QueryBatch)
+	Core.QueryBatch(locations, radius, k, outNeighbours, instigators);
+}
+
+void AOctree::QueryBatchHandles(TArrayView<const FVector3f> locations, float radius, int32 k, TNeighbourBuffer<int32>& outNeighbours, TArrayView<const int32> excludeHandles)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_QueryBatchHandles)
+	Core.QueryBatchHandles(locations, radius, k, outNeighbours, excludeHandles);
+}
+
+void AOctree::QueryBatchByLeaf(float radius, int32 k, int32 numQueries, TArrayView<const int32> queryIndicesByHandle, TNeighbourBuffer<int32>& outNeighbours)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_QueryBatchByLeaf)
+	Core.QueryBatchByLeaf(radius, k, numQueries, queryIndicesByHandle, outNeighbours);
 }
 
-void AOctree::VisualiseNode(UWorld* world, TSharedPtr<FOctreeNode> node, const FColor& color) const
+void AOctree::VisualiseNode(UWorld* world, int32 nodeIndex, const FColor& color) const
 {
-	if (!node) return;
 	if (!bvisualize) return;
-	//if (node->Children.IsEmpty()) return;
-	if (!node->IsLeaf())
+	const FOctreeNode* found = Core.GetTree().FindNode(nodeIndex);
+	if (!found) return;
+	const FOctreeNode& node = *found;
+	if (!node.IsLeaf())
 	{
-		for (auto& child : node->Children)
+		for (int32 i = 0; i < ChildCount; ++i)
 		{
-			VisualiseNode(world, child);
+			VisualiseNode(world, node.FirstChild + i);
 		}
 		return;
 	}
-	//FColor color = DepthToColor(node->Depth);
-	DrawDebugBox(world, node->Bounds.GetCenter(),
-		node->Bounds.GetExtent(), color, false, 0.1f, node->Depth, 2.f);
+	DrawDebugBox(world, node.Bounds.GetCenter(),
+		node.Bounds.GetExtent(), color, false, 0.1f, node.Depth, 2.f);
 
 }
 
 void AOctree::VisualiseTree()
 {
-	VisualiseNode(GetWorld(), root);
+	VisualiseNode(GetWorld(), RootIndex);
 }
 
 void AOctree::ClearTree(bool rebuild)
 {
-	TSharedPtr<FOctreeNode> previous = MakeShared<FOctreeNode>(root->Bounds);
-	ClearNode(root, previous, Parents);
-	Parents.Empty();
-	bIsBuilt = false;
+	Core.Reset();
 	if (rebuild)
 	{
 		Build(WorldBounds);
 	}
 }
 
-void AOctree::RemoveActorFromNode(TSharedPtr<FOctreeNode> node, AActor* actor)
+void AOctree::RemoveActorFromNode(int32 nodeIndex, AActor* actor)
 {
 	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_RemoveActorFromNode)
+	Core.Remove(nodeIndex, actor);
+}
 
-	node->Actors.Remove(actor);
-	TArray<AActor*> toRemove;
-	if (node->IsLeaf() && node->Actors.IsEmpty())
+void AOctree::UpdateAll()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_UpdateAll)
+	if (!Core.IsBuilt())
 	{
-		for (auto& sibling : node->Parent->Children)
-		{
-			if (sibling != node)
-			{
-				if (!sibling->IsLeaf())
-				{
-					continue;
-				}
-				for (auto& siblingActor : sibling->Actors)
-				{
-					if (!sibling->Bounds.IsInside(siblingActor->GetActorLocation()))
-					{
-						toRemove.Add(siblingActor);
-					}
-				}
-				for (auto& actor : toRemove)
-				{
-					sibling->Actors.Remove(actor);
-				}
-			}
-		}
-		bool bClear = true;
-		for (auto& sibling : node->Parent->Children)
-		{
-			if (!sibling->Actors.IsEmpty())
-			{
-				bClear = false;
-				break;
-			}
-			bClear = true;
-		}
-		if (bClear)
-		{
-			node->Parent->Children.Empty();
-		}
+		return;
 	}
-	//ClearTree(true);
-	//for (auto& agent : allActors)
-	//{
-	//	Insert(agent);
-	//}
-	//if (node->IsLeaf() && node->Actors.IsEmpty())
-	//{
-	//	bool bClear = false;
-	//	for (auto& sibling : node->Parent->Children)
-	//	{
-	//		if (sibling != node)
-	//		{
-	//			if (!sibling->IsLeaf())
-	//			{
-	//				
-	//			}
-	//			for (auto& siblingActor : sibling->Actors)
-	//			{
-	//				if (!sibling->Bounds.IsInside(siblingActor->GetActorLocation()))
-	//				{
-	//					toRemove.Add(siblingActor);
-	//				}
-	//			}
-	//			for (auto& actor : toRemove)
-	//			{
-	//				sibling->Actors.Remove(actor);
-	//			}
-	//			if (sibling->Actors.IsEmpty())
-	//			{
-	//				bClear = true;
-	//				continue;
-	//			}
-	//			bClear = false;
-	//			break;
-	//		}
-	//		bClear = true;
-	//	}
-	//	if (bClear)
-	//	{
-	//		node->Parent->Children.Empty();
-	//		return;
-	//	}
-	//	return;
-	//}
+	ApplySettings();
+	// the one place per frame where actor transforms get read, queries only see the packed copies
+	Core.UpdateAll([](AActor* actor, int32 handle) { return FVector3f(actor->GetActorLocation()); });
 }
 
-void AOctree::ClearNode(TSharedPtr<FOctreeNode>& node, TSharedPtr<FOctreeNode>& previous, TArray<TSharedPtr<FOctreeNode>>& parents)
+void AOctree::UpdateFromPositions(TArrayView<const FVector3f> positions, TArrayView<const int32> indicesByHandle)
 {
-	// if node has kids
-	if (!node->IsLeaf())
+	TRACE_CPUPROFILER_EVENT_SCOPE(AOctree_UpdateFromPositions)
+	if (!Core.IsBuilt())
 	{
-		//parents.Add(node);
-		for (auto& child : node->Children)
-		{
-			ClearNode(child, node, parents);
-		}
 		return;
 	}
-	// if it doesnt have kids, return;
-	return;
+	ApplySettings();
+	Core.UpdateAll([positions, indicesByHandle](AActor* actor, int32 handle)
+	{
+		const int32 index = indicesByHandle.IsValidIndex(handle) ? indicesByHandle[handle] : INDEX_NONE;
+		return positions.IsValidIndex(index) ? positions[index] : FVector3f(actor->GetActorLocation());
+	});
 }
 
-
 // Called every frame
 void AOctree::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
-	//if (bIsBuilt)
-	//{
-	//	ClearTree(true);
-	//	for (auto& agent : allActors)
-	//	{
-	//		Insert(agent);
-	//	}
-	//}
+	if (bUpdateInTick)
+	{
+		UpdateAll();
+	}
+	if (bAdaptiveLimits && Core.AdaptLimits(DeltaTime, AdaptInterval, MaxDepth, MaxActorsPerNode))
+	{
+		UE_LOG(LogTemp, Verbose, TEXT("OCTREE limits now MaxDepth %d, MaxActorsPerNode %d"), MaxDepth, MaxActorsPerNode);
+	}
+	Core.PublishFrame();
 	VisualiseTree();
 
 }
-
-
-
-
-
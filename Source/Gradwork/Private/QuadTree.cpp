@@ -8,71 +8,93 @@ AQuadTree::AQuadTree()
 {
 	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
 	PrimaryActorTick.bCanEverTick = true;
+	// agents add this actor as a tick prerequisite, UpdateAll has to run before any of them query
+	PrimaryActorTick.TickGroup = TG_PrePhysics;
+	// keeps the agent's cached leaf in sync with where the tree actually stored it
+	Core.SetOnLeafAssigned([](AActor* actor, int32 nodeIndex)
+	{
+		if (AAgent* agent = Cast<AAgent>(actor))
+		{
+			agent->quadQueryResponder = nodeIndex;
+		}
+	});
+}
 
+bool AQuadTree::IsInsideBounds(AActor* actor)
+{
+	return WorldBounds.IsInside(actor->GetActorLocation());
 }
 
 // Called when the game starts or when spawned
 void AQuadTree::BeginPlay()
 {
 	Super::BeginPlay();
-}
 
+}
 void AQuadTree::EndPlay(const EEndPlayReason::Type reason)
 {
 	Super::EndPlay(reason);
-	if (QueryCount > 0)
-	{
-		double averageQueryTime = TotalQueryTime / double(QueryCount);
-		UE_LOG(LogTemp, Log, TEXT("Average QUADTREE Query time: %f ms over %d queries"), averageQueryTime, QueryCount);
-	}
-	if (InsertCount > 0)
-	{
-		double averageInsertTime = TotalInsertTime / double(InsertCount);
-		UE_LOG(LogTemp, Log, TEXT("Average QUADTREE Insert time: %f ms over %d inserts"), averageInsertTime, InsertCount);
+	Core.CancelAsyncRebuild();
 
-	}
+	Core.GetLatency().Log(TEXT("QUADTREE"));
 }
-
 void AQuadTree::Build(const FBox& bounds)
 {
 	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_Build)
-	if (!bIsBuilt)
+	if (!Core.IsBuilt())
 	{
 		WorldBounds = bounds;
-		root = MakeShared<FQuadTreeNode>(FBox2D(FVector2D(WorldBounds.Min),FVector2D(WorldBounds.Max)));
+		ApplySettings();
+		Core.Build(WorldBounds);
 	}
+}
 
+void AQuadTree::ApplySettings()
+{
+	Core.SetLimits(MaxDepth, MaxActorsPerNode, MergeRatio, MaintenanceInterval);
+	Core.SetZTolerance(zHeightTolerance);
+	Core.bAsyncRebuild = bAsyncRebuild;
+	Core.bCoherentQueries = bCoherentQueries;
 }
-void AQuadTree::VisualiseNode(UWorld* world, TSharedPtr<FQuadTreeNode> node, const FColor& color) const
+
+void AQuadTree::Insert(AActor* actor)
 {
-	if (!node) return;
-	if (!bvisualize) return;
-	if (!node->IsLeaf())
+
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_Insert)
+	if (actor)
 	{
-		for (auto& child : node->Children)
-		{
-			VisualiseNode(world, child);
-		}
-		return;
+		Core.Insert(actor, FVector3f(actor->GetActorLocation()));
 	}
-	DrawDebugBox(world, FVector(node->Bounds.GetCenter(), 1 + node->Depth),
-		FVector(node->Bounds.GetExtent(), 1 + node->Depth), color, false, 0.1f, node->Depth, 2.f);
-
 }
 
-void AQuadTree::VisualizeTree()
+void AQuadTree::InsertBatch(TArrayView<AActor* const> actors)
 {
-	VisualiseNode(GetWorld(), root);
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_InsertBatch)
+	TArray<AActor*> elements;
+	TArray<FVector3f> positions;
+	elements.Reserve(actors.Num());
+	positions.Reserve(actors.Num());
+	for (AActor* actor : actors)
+	{
+		if (actor)
+		{
+			elements.Add(actor);
+			positions.Add(FVector3f(actor->GetActorLocation()));
+		}
+	}
+	Core.InsertBatch(elements, positions);
 }
 
 void AQuadTree::Query(const FVector2D& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator)
 {
 	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_Query)
-	double startTime = FPlatformTime::Seconds() * 1000.f;
-	QueryNode(root, queryLocation, outActors, queryInstigator);
-	double endTime =   FPlatformTime::Seconds() * 1000.f;
-	TotalQueryTime += endTime - startTime;
-	++QueryCount;
+	// a planar location has no height of its own, without an instigator the z band is skipped
+	const bool bHasInstigator = queryInstigator != nullptr;
+	const float instigatorZ = bHasInstigator ? queryInstigator->GetActorLocation().Z : 0.f;
+	Core.QueryLeaf(FVector3f(queryLocation.X, queryLocation.Y, 0.f), outActors, queryInstigator, [this, bHasInstigator, instigatorZ](const FVector3f& position)
+	{
+		return !bHasInstigator || FMath::Abs(position.Z - instigatorZ) < zHeightTolerance;
+	});
 
 }
 FColor AQuadTree::DepthToColor(int32 depth)
@@ -91,265 +113,120 @@ FColor AQuadTree::DepthToColor(int32 depth)
 	return FColor(Red, Green, 0); // Blue is always 0
 }
 
-void AQuadTree::QueryNode(TSharedPtr<FQuadTreeNode> node, const FVector2D& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator)
+void AQuadTree::QueryCircle(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator)
 {
-	//VisualiseNode(GetWorld(), node, FColor::Magenta);
-	if (!node->Bounds.IsInside(queryLocation))
-	{
-		//VisualiseNode(GetWorld(), node, FColor::Red);
-		return;
-	}
-	//if node has kids
-	if (!node->IsLeaf())
-	{
-		//VisualiseNode(GetWorld(), node, FColor::Magenta);
-		for (auto& child : node->Children)
-		{
-			QueryNode(child, queryLocation, outActors, queryInstigator);
-		}
-		return;
-	}
-	// if current node has no kids
-	for (AActor* actor : node->Actors)
-	{
-		if (node->Bounds.IsInside(FVector2D(actor->GetActorLocation())))
-		{
-			if (actor != queryInstigator)
-			{
-				float zDistance = actor->GetActorLocation().Z - queryInstigator->GetActorLocation().Z;
-				if (zDistance < zHeightTolerance)
-				{
-					outActors.AddUnique(actor);
-					AAgent* agent = Cast<AAgent>(outActors.Top());
-					agent->quadQueryResponder = node;
-				}
-				
-			}
-		}
-	}
-	AAgent* agent = Cast<AAgent>(queryInstigator);
-	agent->quadQueryResponder = node;
-	//VisualiseNode(GetWorld(), node, FColor::Blue);
-
-	return;
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_QueryCircle)
 
+	Core.QueryRadius(FVector3f(center), radius, outActors, queryInstigator);
 }
 
-void AQuadTree::Subdivide(TSharedPtr<FQuadTreeNode> node)
+void AQuadTree::QueryBox(const FBox& box, TArray<AActor*>& outActors, AActor* queryInstigator)
 {
-	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_Subdivide)
-	if (!node)
-	{
-		return;
-	}
-	FVector2D min = node->Bounds.Min;
-	FVector2D max = node->Bounds.Max;
-	FVector2D center = (min + max) * 0.5f;
-
-	FBox2D bottomLeft = FBox2D(min, center);
-	FBox2D bottomRight = FBox2D(FVector2D(center.X, min.Y), FVector2D(max.X, center.Y));
-	FBox2D topRight = FBox2D(center, max);
-	FBox2D topLeft = FBox2D(FVector2D(min.X, center.Y), FVector2D(center.X, max.Y));
-
-	// bottom left
-	node->Children.AddUnique(MakeShared<FQuadTreeNode>(bottomLeft));
-	// bottom right	
-	node->Children.AddUnique(MakeShared<FQuadTreeNode>(bottomRight));
-	// top right
-	node->Children.AddUnique(MakeShared<FQuadTreeNode>(topRight));
-	// top left
-	node->Children.AddUnique(MakeShared<FQuadTreeNode>(topLeft));
-	for (auto& child : node->Children)
-	{
-		child->Parent = node;
-	}
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_QueryBox)
+
+	Core.QueryBox(box, outActors, queryInstigator);
 }
 
-void AQuadTree::Insert(AActor* actor)
+void AQuadTree::QueryKNearest(const FVector& location, int32 k, float maxRadius, TArray<AActor*>& outActors, AActor* queryInstigator)
 {
-	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_Insert)
-	double startTime = FPlatformTime::Seconds() * 1000.f;
-	if (!actor || !root->Bounds.IsInside(FVector2D(actor->GetActorLocation())))
-	{
-		return;
-	}
-	InsertNode(root, actor);
-	double endTime = FPlatformTime::Seconds() * 1000.f;
-	TotalInsertTime += endTime - startTime;
-	++InsertCount;
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_QueryKNearest)
+	Core.QueryKNearest(FVector3f(location), k, maxRadius, outActors, queryInstigator);
 }
-void AQuadTree::InsertNode(TSharedPtr<FQuadTreeNode>& node, AActor* actor)
-{
-	if (!actor || !node->Bounds.IsInside(FVector2D(actor->GetActorLocation())))
-	{
-		return;
-	}
-	// if node has children
-	if (!node->IsLeaf())
-	{
-		for (auto& child : node->Children)
-		{
-			InsertNode(child, actor);
-		}
-		return;
-	}
-	// if node doesnt have children and can insert new actors
-	if (node->IsLeaf() && node->Actors.Num() < MaxActorsPerNode)
-	{
-		node->Actors.AddUnique(actor);
-		return;
-	}
-
 
-	// if current node has no children
-	if (node->Depth < MaxDepth)
-	{
-		Subdivide(node);
-		for (auto& child : node->Children)
-		{
-			child->Depth = node->Depth + 1;
-			//new actor to add
-			if (child->Bounds.IsInside(FVector2D(actor->GetActorLocation())))
-			{
-				InsertNode(child, actor);
-			}
-			// actor from parent
-			for (auto& parentActor : node->Actors)
-			{
-				if (child->Bounds.IsInside(FVector2D(parentActor->GetActorLocation())))
-				{
-					InsertNode(child, parentActor);
-				}
-			}
-		}
-		node->Actors.Empty();
-		return;
-	}
-	// final depth has been reached + more than max amount agents per node, adding to node as a last resort
-	node->Actors.Add(actor);
-	return;
-
-	//if (node->Actors.Num() < MaxActors)
-	//{
-	//	node->Actors.AddUnique(actor);
-	//	return;
-	//}
-	// if there are more actors in the node
-	//if (node->Actors.Num() >= MaxActors)
-	//{
-	//	if (node->Depth < MaxDepth)
-	//	{
-	//		Subdivide(node);
-	//		//DFS
-	//		for (auto& child : node->Children)
-	//		{
-	//			child->Depth = node->Depth + 1;
-	//			if (child->Bounds.IsInside(FVector2D(actor->GetActorLocation())))
-	//			{
-	//				InsertNode(child, actor);
-	//			}
-	//			for (auto& childActor : node->Actors)
-	//			{
-	//				if (child->Bounds.IsInside(FVector2D(childActor->GetActorLocation())))
-	//				{
-	//					InsertNode(child, childActor);
-	//				}
-	//			}
-	//
-	//		}
-	//		node->Actors.Empty();
-	//		return;
-	//	}
-	//	node->Actors.AddUnique(actor);
-	//	return;
-	//}
-	// if max depth has been reached
-	//node->Children.Empty();
+void AQuadTree::QueryBatch(TArrayView<const FVector> locations, float radius, int32 k, FNeighbourBuffer& outNeighbours, TArrayView<AActor* const> instigators)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_QueryBatch)
+	Core.QueryBatch(locations, radius, k, outNeighbours, instigators);
 }
 
+void AQuadTree::QueryBatchHandles(TArrayView<const FVector3f> locations, float radius, int32 k, TNeighbourBuffer<int32>& outNeighbours, TArrayView<const int32> excludeHandles)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_QueryBatchHandles)
+	Core.QueryBatchHandles(locations, radius, k, outNeighbours, excludeHandles);
+}
 
+void AQuadTree::QueryBatchByLeaf(float radius, int32 k, int32 numQueries, TArrayView<const int32> queryIndicesByHandle, TNeighbourBuffer<int32>& outNeighbours)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_QueryBatchByLeaf)
+	Core.QueryBatchByLeaf(radius, k, numQueries, queryIndicesByHandle, outNeighbours);
+}
 
-void AQuadTree::RemoveActorFromNode(TSharedPtr<FQuadTreeNode> node, AActor* actor)
+void AQuadTree::VisualiseNode(UWorld* world, int32 nodeIndex, const FColor& color) const
 {
-	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_RemoveActorFromNode)
-	node->Actors.Remove(actor);
-	TArray<AActor*> toRemove;
-	if (node->IsLeaf() && node->Actors.IsEmpty())
+	if (!bvisualize) return;
+	const FQuadTreeNode* found = Core.GetTree().FindNode(nodeIndex);
+	if (!found) return;
+	const FQuadTreeNode& node = *found;
+	if (!node.IsLeaf())
 	{
-		for (auto& sibling : node->Parent->Children)
+		for (int32 i = 0; i < ChildCount; ++i)
 		{
-			if (sibling != node)
-			{
-				if (!sibling->IsLeaf())
-				{
-					continue;
-				}
-				for (auto& siblingActor : sibling->Actors)
-				{
-					if (!sibling->Bounds.IsInside(FVector2D(siblingActor->GetActorLocation())))
-					{
-						toRemove.Add(siblingActor);
-					}
-				}
-				for (auto& actor : toRemove)
-				{
-					sibling->Actors.Remove(actor);
-				}
-			}
-		}
-		bool bClear = true;
-		for (auto& sibling : node->Parent->Children)
-		{
-			if (!sibling->Actors.IsEmpty())
-			{
-				bClear = false;
-				break;
-			}
-			bClear = true;
-		}
-		if (bClear)
-		{
-			node->Parent->Children.Empty();
+			VisualiseNode(world, node.FirstChild + i);
 		}
+		return;
 	}
+	DrawDebugBox(world, FVector(node.Bounds.GetCenter(), 1 + node.Depth),
+		FVector(node.Bounds.GetExtent(), 1 + node.Depth), color, false, 0.1f, node.Depth, 2.f);
+
 }
 
-bool AQuadTree::IsInsideBounds(AActor* actor)
+void AQuadTree::VisualizeTree()
 {
-	return WorldBounds.IsInside(actor->GetActorLocation());
+	VisualiseNode(GetWorld(), RootIndex);
 }
 
 void AQuadTree::ClearTree()
 {
-	TSharedPtr<FQuadTreeNode> previous = MakeShared<FQuadTreeNode>(root->Bounds);
-	ClearNode(root, previous,Parents);
-	Parents.Empty();
+	Core.Reset();
 	Build(WorldBounds);
 }
-void AQuadTree::ClearNode(TSharedPtr<FQuadTreeNode>& node, TSharedPtr<FQuadTreeNode>& previous, TArray<TSharedPtr<FQuadTreeNode>>& parents)
+
+void AQuadTree::RemoveActorFromNode(int32 nodeIndex, AActor* actor)
 {
-	// if node has kids
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_RemoveActorFromNode)
+	Core.Remove(nodeIndex, actor);
+}
 
-	if (!node->IsLeaf())
+void AQuadTree::UpdateAll()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_UpdateAll)
+	if (!Core.IsBuilt())
 	{
-		parents.Add(node);
-		for (auto& child : node->Children)
-		{
-			ClearNode(child, node,parents);
-		}
 		return;
 	}
-	// if it doesnt have kids, return;
-	return;
+	ApplySettings();
+	// the one place per frame where actor transforms get read, queries only see the packed copies
+	Core.UpdateAll([](AActor* actor, int32 handle) { return FVector3f(actor->GetActorLocation()); });
 }
+
+void AQuadTree::UpdateFromPositions(TArrayView<const FVector3f> positions, TArrayView<const int32> indicesByHandle)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AQuadTree_UpdateFromPositions)
+	if (!Core.IsBuilt())
+	{
+		return;
+	}
+	ApplySettings();
+	Core.UpdateAll([positions, indicesByHandle](AActor* actor, int32 handle)
+	{
+		const int32 index = indicesByHandle.IsValidIndex(handle) ? indicesByHandle[handle] : INDEX_NONE;
+		return positions.IsValidIndex(index) ? positions[index] : FVector3f(actor->GetActorLocation());
+	});
+}
+
 // Called every frame
 void AQuadTree::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
-	//if (bvisualize)
-	//{
+	if (bUpdateInTick)
+	{
+		UpdateAll();
+	}
+	if (bAdaptiveLimits && Core.AdaptLimits(DeltaTime, AdaptInterval, MaxDepth, MaxActorsPerNode))
+	{
+		UE_LOG(LogTemp, Verbose, TEXT("QUADTREE limits now MaxDepth %d, MaxActorsPerNode %d"), MaxDepth, MaxActorsPerNode);
+	}
+	Core.PublishFrame();
 	VisualizeTree();
-	//}
-}
-
 
+}
@@ -0,0 +1,402 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "SpatialHashGrid.h"
+#include "LeafScan.h"
+#include "DrawDebugHelpers.h"
+
+// Sets default values
+ASpatialHashGrid::ASpatialHashGrid()
+{
+	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+	// agents add this actor as a tick prerequisite, UpdateAll has to run before any of them query
+	PrimaryActorTick.TickGroup = TG_PrePhysics;
+}
+
+// Called when the game starts or when spawned
+void ASpatialHashGrid::BeginPlay()
+{
+	Super::BeginPlay();
+
+}
+
+void ASpatialHashGrid::EndPlay(EEndPlayReason::Type reason)
+{
+	Super::EndPlay(reason);
+
+	Latency.Log(TEXT("HASH GRID"));
+}
+
+bool ASpatialHashGrid::IsInsideBounds(AActor* actor)
+{
+	return WorldBounds.IsInside(actor->GetActorLocation());
+}
+
+void ASpatialHashGrid::Build(const FBox& bounds)
+{
+	if (bIsBuilt)
+	{
+		return;
+	}
+	WorldBounds = bounds;
+	const FVector size = WorldBounds.GetSize();
+	const int32 maxCellsPerAxis = FMath::Clamp(MaxCellsPerAxis, 1, 1024);
+	auto cellsAlong = [this, maxCellsPerAxis](double extent)
+	{
+		return FMath::Clamp(FMath::CeilToInt(extent / FMath::Max(CellSize, 1.f)), 1, maxCellsPerAxis);
+	};
+	CellCounts = FIntVector(cellsAlong(size.X), cellsAlong(size.Y), cellsAlong(size.Z));
+	// the cells tile the bounds exactly, so they end up at least CellSize wide
+	InvCellSize.X = size.X > 0.0 ? CellCounts.X / size.X : 0.0;
+	InvCellSize.Y = size.Y > 0.0 ? CellCounts.Y / size.Y : 0.0;
+	InvCellSize.Z = size.Z > 0.0 ? CellCounts.Z / size.Z : 0.0;
+	Cells.Reset();
+	CellKeys.Reset();
+	RehashCells();
+	bIsBuilt = true;
+	// anything registered before the grid had cells goes in now
+	for (int32 handle = 0; handle < Elements.Num(); ++handle)
+	{
+		Insert(Elements[handle]);
+	}
+}
+
+SIZE_T ASpatialHashGrid::GetAllocatedSize() const
+{
+	SIZE_T size = Cells.GetAllocatedSize() + CellKeys.GetAllocatedSize() + CellTable.GetAllocatedSize()
+		+ Elements.GetAllocatedSize() + ElementCells.GetAllocatedSize() + ElementHandles.GetAllocatedSize();
+	for (const FGridCell& cell : Cells)
+	{
+		size += cell.GetAllocatedSize();
+	}
+	return size;
+}
+
+FIntVector ASpatialHashGrid::GetCellCoordinates(const FVector& location) const
+{
+	// locations outside the bounds land in the border cells, so nothing ever falls out of the grid
+	const FVector local = (location - WorldBounds.Min) * InvCellSize;
+	return FIntVector(
+		FMath::Clamp(FMath::FloorToInt(local.X), 0, CellCounts.X - 1),
+		FMath::Clamp(FMath::FloorToInt(local.Y), 0, CellCounts.Y - 1),
+		FMath::Clamp(FMath::FloorToInt(local.Z), 0, CellCounts.Z - 1));
+}
+
+FBox ASpatialHashGrid::GetCellBounds(const FIntVector& coordinates) const
+{
+	const FVector cellSize = WorldBounds.GetSize() / FVector(CellCounts);
+	const FVector min = WorldBounds.Min + FVector(coordinates) * cellSize;
+	return FBox(min, min + cellSize);
+}
+
+int32 ASpatialHashGrid::FindCell(int32 key) const
+{
+	// fibonacci hashing, the top bits of the product pick the bucket
+	const uint32 mask = uint32(CellTable.Num() - 1);
+	for (uint32 bucket = (uint32(key) * 2654435769u) >> CellTableShift;; bucket = (bucket + 1) & mask)
+	{
+		const int32 cellIndex = CellTable[bucket];
+		if (cellIndex == INDEX_NONE || CellKeys[cellIndex] == key)
+		{
+			return cellIndex;
+		}
+	}
+}
+
+int32 ASpatialHashGrid::FindOrAddCell(int32 key)
+{
+	const int32 found = FindCell(key);
+	if (found != INDEX_NONE)
+	{
+		return found;
+	}
+	const int32 cellIndex = Cells.AddDefaulted();
+	CellKeys.Add(key);
+	if (Cells.Num() * 2 > CellTable.Num())
+	{
+		RehashCells();
+		return cellIndex;
+	}
+	const uint32 mask = uint32(CellTable.Num() - 1);
+	uint32 bucket = (uint32(key) * 2654435769u) >> CellTableShift;
+	while (CellTable[bucket] != INDEX_NONE)
+	{
+		bucket = (bucket + 1) & mask;
+	}
+	CellTable[bucket] = cellIndex;
+	return cellIndex;
+}
+
+void ASpatialHashGrid::RehashCells()
+{
+	const int32 numBuckets = int32(FMath::RoundUpToPowerOfTwo(uint32(FMath::Max(Cells.Num() * 2, 16))));
+	CellTableShift = 32 - FMath::FloorLog2(uint32(numBuckets));
+	CellTable.Init(INDEX_NONE, numBuckets);
+	const uint32 mask = uint32(numBuckets - 1);
+	for (int32 cellIndex = 0; cellIndex < CellKeys.Num(); ++cellIndex)
+	{
+		uint32 bucket = (uint32(CellKeys[cellIndex]) * 2654435769u) >> CellTableShift;
+		while (CellTable[bucket] != INDEX_NONE)
+		{
+			bucket = (bucket + 1) & mask;
+		}
+		CellTable[bucket] = cellIndex;
+	}
+}
+
+void ASpatialHashGrid::ReleaseEmptyCells()
+{
+	int32 numEmpty = 0;
+	for (const FGridCell& cell : Cells)
+	{
+		numEmpty += cell.Num() == 0;
+	}
+	// keeps a crowd that shuffles between the same few cells from rehashing every frame
+	if (numEmpty * 2 <= Cells.Num())
+	{
+		return;
+	}
+	int32 write = 0;
+	for (int32 read = 0; read < Cells.Num(); ++read)
+	{
+		if (Cells[read].Num() == 0)
+		{
+			continue;
+		}
+		if (write != read)
+		{
+			Cells[write] = MoveTemp(Cells[read]);
+			CellKeys[write] = CellKeys[read];
+			for (int32 handle : Cells[write].Handles)
+			{
+				ElementCells[handle] = write;
+			}
+		}
+		++write;
+	}
+	Cells.SetNum(write);
+	CellKeys.SetNum(write);
+	RehashCells();
+}
+
+int32 ASpatialHashGrid::GetHandle(AActor* actor)
+{
+	if (const int32* existing = ElementHandles.Find(actor))
+	{
+		return *existing;
+	}
+	const int32 handle = Elements.Add(actor);
+	ElementCells.Add(INDEX_NONE);
+	ElementHandles.Add(actor, handle);
+	return handle;
+}
+
+void ASpatialHashGrid::Insert(AActor* actor)
+{
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkInsert, &Latency.Insert);
+	if (!actor)
+	{
+		return;
+	}
+	const int32 handle = GetHandle(actor);
+	if (!bIsBuilt || ElementCells[handle] != INDEX_NONE)
+	{
+		return;
+	}
+	const FVector location = actor->GetActorLocation();
+	const int32 cellIndex = FindOrAddCell(GetCellKey(location));
+	Cells[cellIndex].AddElement(actor, FVector3f(location), handle);
+	ElementCells[handle] = cellIndex;
+}
+
+void ASpatialHashGrid::Remove(AActor* actor)
+{
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkRemove, &Latency.Remove);
+	const int32* handle = ElementHandles.Find(actor);
+	if (!handle || ElementCells[*handle] == INDEX_NONE)
+	{
+		return;
+	}
+	// the handle stays reserved for the actor in case it gets inserted again, an emptied cell goes at the next update
+	FGridCell& cell = Cells[ElementCells[*handle]];
+	const int32 index = cell.Handles.Find(*handle);
+	if (index != INDEX_NONE)
+	{
+		cell.RemoveElementAtSwap(index);
+	}
+	ElementCells[*handle] = INDEX_NONE;
+}
+
+template <typename PositionFunc>
+void ASpatialHashGrid::UpdateCells(PositionFunc&& getPosition)
+{
+	for (int32 cellIndex = 0; cellIndex < Cells.Num(); ++cellIndex)
+	{
+		const int32 cellKey = CellKeys[cellIndex];
+		// walking backwards lets RemoveElementAtSwap pull in an element that has already been refreshed
+		for (int32 i = Cells[cellIndex].Num() - 1; i >= 0; --i)
+		{
+			// looked up again every time, a cell added below can move the others
+			FGridCell& cell = Cells[cellIndex];
+			const FVector3f position = getPosition(cell.Actors[i], cell.Handles[i]);
+			const int32 newCellKey = GetCellKey(FVector(position));
+			if (newCellKey == cellKey)
+			{
+				cell.X[i] = position.X;
+				cell.Y[i] = position.Y;
+				cell.Z[i] = position.Z;
+				continue;
+			}
+			// a move into a cell further along, or a new one, only costs it one extra refresh when the loop gets there
+			const int32 handle = cell.Handles[i];
+			AActor* actor = cell.Actors[i];
+			cell.RemoveElementAtSwap(i);
+			const int32 newCellIndex = FindOrAddCell(newCellKey);
+			Cells[newCellIndex].AddElement(actor, position, handle);
+			ElementCells[handle] = newCellIndex;
+		}
+	}
+	ReleaseEmptyCells();
+}
+
+void ASpatialHashGrid::UpdateAll()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ASpatialHashGrid_UpdateAll)
+	if (!bIsBuilt)
+	{
+		return;
+	}
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkUpdate, &Latency.Update);
+
+	UpdateCells([](AActor* actor, int32 handle) { return FVector3f(actor->GetActorLocation()); });
+}
+
+void ASpatialHashGrid::UpdateFromPositions(TArrayView<const FVector3f> positions, TArrayView<const int32> indicesByHandle)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ASpatialHashGrid_UpdateFromPositions)
+	if (!bIsBuilt)
+	{
+		return;
+	}
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkUpdate, &Latency.Update);
+
+	UpdateCells([positions, indicesByHandle](AActor* actor, int32 handle)
+	{
+		const int32 index = indicesByHandle.IsValidIndex(handle) ? indicesByHandle[handle] : INDEX_NONE;
+		return positions.IsValidIndex(index) ? positions[index] : FVector3f(actor->GetActorLocation());
+	});
+}
+
+void ASpatialHashGrid::Query(const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ASpatialHashGrid_Query)
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+
+	const int32 cellIndex = bIsBuilt && WorldBounds.IsInside(queryLocation) ? FindCell(GetCellKey(queryLocation)) : INDEX_NONE;
+	if (cellIndex != INDEX_NONE)
+	{
+		for (AActor* actor : Cells[cellIndex].Actors)
+		{
+			if (actor != queryInstigator)
+			{
+				outActors.AddUnique(actor);
+			}
+		}
+	}
+}
+
+template <typename TItem>
+void ASpatialHashGrid::QuerySphereCells(const FVector3f& center, float radius, TArray<TItem>& outItems, TItem exclude, TArray<TItem> FGridCell::* items) const
+{
+	const FIntVector min = GetCellCoordinates(FVector(center - FVector3f(radius)));
+	const FIntVector max = GetCellCoordinates(FVector(center + FVector3f(radius)));
+	const float radiusSquared = radius * radius;
+	auto scan = [&](const FGridCell& cell)
+	{
+		LeafScan::Sphere(cell.X.GetData(), cell.Y.GetData(), cell.Z.GetData(), (cell.*items).GetData(), cell.Num(),
+			center, radiusSquared, outItems, exclude);
+	};
+	// a radius much larger than the cells covers more coordinates than there are cells to look at
+	const int64 numCovered = int64(max.X - min.X + 1) * (max.Y - min.Y + 1) * (max.Z - min.Z + 1);
+	if (numCovered > Cells.Num())
+	{
+		for (int32 cellIndex = 0; cellIndex < Cells.Num(); ++cellIndex)
+		{
+			const FIntVector coordinates = GetKeyCoordinates(CellKeys[cellIndex]);
+			if (coordinates.X >= min.X && coordinates.X <= max.X && coordinates.Y >= min.Y && coordinates.Y <= max.Y && coordinates.Z >= min.Z && coordinates.Z <= max.Z)
+			{
+				scan(Cells[cellIndex]);
+			}
+		}
+		return;
+	}
+	for (int32 z = min.Z; z <= max.Z; ++z)
+	{
+		for (int32 y = min.Y; y <= max.Y; ++y)
+		{
+			for (int32 x = min.X; x <= max.X; ++x)
+			{
+				const int32 cellIndex = FindCell(GetCellKey(FIntVector(x, y, z)));
+				if (cellIndex != INDEX_NONE)
+				{
+					scan(Cells[cellIndex]);
+				}
+			}
+		}
+	}
+}
+
+void ASpatialHashGrid::QuerySphere(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ASpatialHashGrid_QuerySphere)
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+
+	if (bIsBuilt)
+	{
+		QuerySphereCells(FVector3f(center), radius, outActors, queryInstigator, &FGridCell::Actors);
+	}
+}
+
+void ASpatialHashGrid::QueryBatchHandles(TArrayView<const FVector3f> locations, float radius, TNeighbourBuffer<int32>& outNeighbours, TArrayView<const int32> excludeHandles)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(ASpatialHashGrid_QueryBatchHandles)
+	GRADWORK_SCOPE_LATENCY(STAT_GradworkQueryBatch, &Latency.QueryBatch);
+
+	if (bIsBuilt)
+	{
+		outNeighbours.Fill(locations.Num(), [this, locations, radius, excludeHandles](int32 queryIndex, TArray<int32>& out)
+		{
+			const int32 excludeHandle = excludeHandles.IsValidIndex(queryIndex) ? excludeHandles[queryIndex] : INDEX_NONE;
+			QuerySphereCells(locations[queryIndex], radius, out, excludeHandle, &FGridCell::Handles);
+		});
+	}
+}
+
+void ASpatialHashGrid::VisualiseGrid()
+{
+	if (!bvisualize) return;
+	// only occupied cells, drawing every cell of a big grid is unreadable anyway
+	for (int32 cellIndex = 0; cellIndex < Cells.Num(); ++cellIndex)
+	{
+		if (Cells[cellIndex].Num() == 0)
+		{
+			continue;
+		}
+		const FBox bounds = GetCellBounds(GetKeyCoordinates(CellKeys[cellIndex]));
+		DrawDebugBox(GetWorld(), bounds.GetCenter(), bounds.GetExtent(), FColor::Cyan, false, 0.1f, 0, 2.f);
+	}
+}
+
+// Called every frame
+void ASpatialHashGrid::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+	if (bUpdateInTick)
+	{
+		UpdateAll();
+	}
+	Latency.PublishFrame();
+	VisualiseGrid();
+
+}
@@ -0,0 +1,106 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "SpatialTreeTuner.h"
+
+bool FSpatialTreeTuner::Evaluate(const FGradworkLatencyStats& latency, const FSpatialTreeStats& stats, int32 numFrames, int32& inOutMaxDepth, int32& inOutMaxElementsPerNode)
+{
+	// subdivides and collapses happen inside insert and update, they are already part of these
+	const uint64 queryCycles = latency.Query.TotalCycles + latency.QueryBatch.TotalCycles;
+	const uint64 cycles = queryCycles + latency.Insert.TotalCycles + latency.Remove.TotalCycles + latency.Update.TotalCycles;
+	// the histograms only ever grow unless somebody reset them
+	const uint64 intervalCycles = cycles >= LastCycles ? cycles - LastCycles : cycles;
+	const uint64 intervalQueryCycles = queryCycles >= LastQueryCycles ? queryCycles - LastQueryCycles : queryCycles;
+	LastCycles = cycles;
+	LastQueryCycles = queryCycles;
+	// the histograms don't start over with the tuner, the first call only takes their totals
+	const bool bHadBaseline = bHasBaseline;
+	bHasBaseline = true;
+	if (!bHadBaseline || numFrames <= 0 || stats.ElementCount == 0)
+	{
+		return false;
+	}
+	const double queryCost = double(intervalQueryCycles) / double(numFrames) / double(stats.ElementCount);
+
+	// the depth came down last interval, it only stays down when the queries didn't get slower for it
+	if (QueryCostBeforeShallower >= 0.0)
+	{
+		const double costBefore = QueryCostBeforeShallower;
+		QueryCostBeforeShallower = -1.0;
+		if (queryCost > costBefore * (1.0 + Tolerance) && inOutMaxDepth < MaxDepthLimit)
+		{
+			++inOutMaxDepth;
+			// don't try the shallower tree again until the tuner is reset
+			DepthFloor = inOutMaxDepth;
+			LastCost = -1.0;
+			return true;
+		}
+	}
+
+	const int32 occupiedLeaves = stats.LeafCount - stats.EmptyLeafCount;
+	if (stats.OverCapacityLeafCount > occupiedLeaves * OverCapacityShare && inOutMaxDepth < MaxDepthLimit)
+	{
+		++inOutMaxDepth;
+		// the cost of this interval says nothing about the new depth, start the element limit over from here
+		LastCost = -1.0;
+		return true;
+	}
+
+	// a flock that dispersed leaves the deepest leaves holding a handful each, a level less merges them back
+	const TArray<int32>& deepLeaves = stats.MaxDepthOccupancyHistogram;
+	const int32 underFilledMax = FMath::Max(1, int32(inOutMaxElementsPerNode * UnderFillRatio));
+	int32 occupiedDeepLeaves = 0;
+	int32 underFilledLeaves = 0;
+	for (int32 num = 1; num < deepLeaves.Num(); ++num)
+	{
+		occupiedDeepLeaves += deepLeaves[num];
+		underFilledLeaves += num <= underFilledMax ? deepLeaves[num] : 0;
+	}
+	// the merged leaves mustn't end up over capacity, the check above would only raise MaxDepth again next time
+	if (stats.OverCapacityLeafCount == 0 && stats.OverCapacityParentCount <= occupiedLeaves * OverCapacityShare
+		&& underFilledLeaves > occupiedDeepLeaves * UnderFilledShare && inOutMaxDepth > FMath::Max(MinDepthLimit, DepthFloor))
+	{
+		--inOutMaxDepth;
+		QueryCostBeforeShallower = queryCost;
+		LastCost = -1.0;
+		return true;
+	}
+
+	// per element, a flock forming or dispersing changes the total but shouldn't read as the limits getting worse
+	const double cost = double(intervalCycles) / double(numFrames) / double(stats.ElementCount);
+	if (LastCost >= 0.0)
+	{
+		if (FMath::Abs(cost - LastCost) <= LastCost * Tolerance)
+		{
+			LastCost = cost;
+			return false;
+		}
+		if (cost > LastCost)
+		{
+			Direction = -Direction;
+		}
+	}
+	LastCost = cost;
+
+	const int32 step = FMath::Max(1, inOutMaxElementsPerNode / 4);
+	const int32 elements = FMath::Clamp(inOutMaxElementsPerNode + Direction * step, MinElementsPerNode, MaxElementsPerNodeLimit);
+	if (elements == inOutMaxElementsPerNode)
+	{
+		// ran into a bound, the next step goes the other way
+		Direction = -Direction;
+		return false;
+	}
+	inOutMaxElementsPerNode = elements;
+	return true;
+}
+
+void FSpatialTreeTuner::Reset()
+{
+	LastCycles = 0;
+	LastQueryCycles = 0;
+	LastCost = -1.0;
+	QueryCostBeforeShallower = -1.0;
+	DepthFloor = 0;
+	bHasBaseline = false;
+	Direction = 1;
+}
@@ -0,0 +1,104 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "Trajectory.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Async/MappedFileHandle.h"
+
+static_assert(sizeof(FTrajectoryHeader) <= FTrajectoryHeader::Size, "the header has to fit in front of the first frame");
+
+FTrajectoryWriter::~FTrajectoryWriter()
+{
+	Close();
+}
+
+bool FTrajectoryWriter::Open(const FString& path, int32 numAgents, const FBox& bounds)
+{
+	Close();
+	Archive.Reset(IFileManager::Get().CreateFileWriter(*path));
+	if (!Archive)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Could not open trajectory file %s for writing"), *path);
+		return false;
+	}
+	Header = FTrajectoryHeader();
+	Header.NumAgents = numAgents;
+	Header.BoundsMin = FVector3f(bounds.Min);
+	Header.BoundsMax = FVector3f(bounds.Max);
+	WriteHeader();
+	return true;
+}
+
+void FTrajectoryWriter::WriteHeader()
+{
+	uint8 bytes[FTrajectoryHeader::Size] = {};
+	FMemory::Memcpy(bytes, &Header, sizeof(FTrajectoryHeader));
+	Archive->Seek(0);
+	Archive->Serialize(bytes, FTrajectoryHeader::Size);
+}
+
+void FTrajectoryWriter::AddFrame(TArrayView<const FVector3f> positions)
+{
+	if (!Archive || positions.Num() != Header.NumAgents)
+	{
+		return;
+	}
+	Archive->Serialize(const_cast<FVector3f*>(positions.GetData()), positions.Num() * sizeof(FVector3f));
+	++Header.NumFrames;
+}
+
+void FTrajectoryWriter::Close()
+{
+	if (!Archive)
+	{
+		return;
+	}
+	// frame count goes into the header now that it is known
+	const int64 end = Archive->Tell();
+	WriteHeader();
+	Archive->Seek(end);
+	Archive->Close();
+	Archive.Reset();
+}
+
+FTrajectoryReader::FTrajectoryReader() = default;
+FTrajectoryReader::~FTrajectoryReader() = default;
+
+bool FTrajectoryReader::Open(const FString& path)
+{
+	Frames = nullptr;
+	MappedRegion.Reset();
+	MappedFile.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*path));
+	if (MappedFile)
+	{
+		MappedRegion.Reset(MappedFile->MapRegion());
+	}
+	if (!MappedRegion || MappedRegion->GetMappedSize() < FTrajectoryHeader::Size)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Could not map trajectory file %s"), *path);
+		return false;
+	}
+	FMemory::Memcpy(&Header, MappedRegion->GetMappedPtr(), sizeof(FTrajectoryHeader));
+	if (Header.Magic != FTrajectoryHeader::FileMagic || Header.Version != FTrajectoryHeader::FileVersion || Header.NumAgents <= 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("%s is not a trajectory file this build can read"), *path);
+		MappedRegion.Reset();
+		return false;
+	}
+	// a writer that never got closed leaves 0 frames in the header, and a cut off file has fewer than it says
+	const int64 frameSize = int64(Header.NumAgents) * sizeof(FVector3f);
+	const int32 framesOnDisk = int32((MappedRegion->GetMappedSize() - FTrajectoryHeader::Size) / frameSize);
+	Header.NumFrames = Header.NumFrames > 0 ? FMath::Min(Header.NumFrames, framesOnDisk) : framesOnDisk;
+	Frames = reinterpret_cast<const FVector3f*>(MappedRegion->GetMappedPtr() + FTrajectoryHeader::Size);
+	return true;
+}
+
+TArrayView<const FVector3f> FTrajectoryReader::GetFrame(int32 frame) const
+{
+	if (!Frames || frame < 0 || frame >= Header.NumFrames)
+	{
+		return TArrayView<const FVector3f>();
+	}
+	return TArrayView<const FVector3f>(Frames + int64(frame) * Header.NumAgents, Header.NumAgents);
+}
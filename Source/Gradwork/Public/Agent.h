@@ -13,13 +13,17 @@ enum class ESteeringType : uint8
 {
 	seperation,
 	allignment,
-	cohesion
+	cohesion,
+	// all three at once, blended by the weights
+	weighted
 };
 UCLASS()
 class GRADWORK_API AAgent : public AActor
 {
 	GENERATED_BODY()
-	
+	// copies the agent's state in and steps it from then on
+	friend class AAgentSimulation;
+
 public:	
 	// Sets default values for this actor's properties
 	AAgent();
@@ -33,20 +37,52 @@ public:
 	TArray<AActor*> OtherActors;
 	UPROPERTY(EditAnyWhere,BlueprintReadWrite)
 	float Speed;
-	TSharedPtr<FOctreeNode> octQueryResponder;
-	TSharedPtr<FQuadTreeNode> quadQueryResponder;
+	// only steer on the closest few neighbours in range, 0 uses every neighbour in range
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	int32 MaxNeighbours = 0;
+	// index of the leaf in the tree's node pool that last answered a query for this agent
+	int32 octQueryResponder = INDEX_NONE;
+	int32 quadQueryResponder = INDEX_NONE;
+	// steer with the weighted blend of all three behaviours instead of separation only
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bBlendedSteering = false;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 	float seperationWeight = 0.f;
 	float seperationRange = 300.f;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 	float allignmentWeight = 0.f;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 	float cohesionWeight   = 0.f;
+	// Verlet skin. Above 0 the tree is queried with seperationRange + NeighbourSkin and the result kept until any
+	// agent has moved more than half the smallest skin in use, OtherActors gets filtered out of it by exact distance
+	// every frame in between. Respawns and fast agents invalidate every list, see AGradworkGameMode::GetNeighbourListEpoch.
+	// 0 queries the tree every frame.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float NeighbourSkin = 0.f;
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
 private:	
+	// one query of the structure for the agent's tree type, replaces outActors
+	void QueryNeighbours(float range, int32 maxNeighbours, TArray<AActor*>& outActors);
+	// OtherActors from NeighbourList, within seperationRange and cut down to the MaxNeighbours closest
+	void FilterNeighbourList();
+	// bumps the neighbour list epoch once this agent got too far from NeighbourListOrigin, runs right after every move
+	void CheckNeighbourListDisplacement();
+	// everything within seperationRange + NeighbourSkin of NeighbourListOrigin
+	UPROPERTY()
+	TArray<AActor*> NeighbourList;
+	// where this agent was when it first queried in the current epoch
+	FVector NeighbourListOrigin;
+	// epoch NeighbourList and NeighbourListOrigin belong to, INDEX_NONE before the first query
+	int32 NeighbourListEpoch = INDEX_NONE;
+	AGradworkGameMode* GameMode;
 	ETreeType TreeType;
 	FVector Direction;
 	AQuadTree* QuadTree;
 	AOctree* Octree;
+	ALinearTree* LinearTree;
+	ASpatialHashGrid* HashGrid;
 	ESteeringType SteeringType;
 };
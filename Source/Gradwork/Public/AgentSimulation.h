@@ -0,0 +1,109 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "Agent.h"
+#include "NeighbourBuffer.h"
+#include "GradworkStats.h"
+#include "Steering.h"
+#include "Trajectory.h"
+#include "AgentSimulation.generated.h"
+
+class UInstancedStaticMeshComponent;
+
+// Steps every agent in one tick instead of one AAgent::Tick per actor.
+// Agent state lives in parallel arrays indexed by agent, the tree gets refreshed from those in one batch,
+// queried in one batch, and transforms are pushed back to the actors and/or instances once at the end.
+UCLASS()
+class GRADWORK_API AAgentSimulation : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	// Sets default values for this actor's properties
+	AAgentSimulation();
+
+	// Called every frame
+	virtual void Tick(float DeltaTime) override;
+	// copies the agent's state in, makes sure it is in the tree and remembers its handle
+	void AddAgent(AAgent* agent);
+	int32 GetNumAgents() const { return Agents.Num(); }
+	// write the new locations back to the agent actors, turn off when only the instances get drawn
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bPushToActors = true;
+	// optional, agent i is drawn as instance i
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	UInstancedStaticMeshComponent* InstancedMesh = nullptr;
+	// steer the agents on the task graph. results are the same either way, this is here to measure the scaling
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bParallelSteer = true;
+	// seeds the respawn of agents that left the bounds, the same seed replays the same run
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	int32 Seed = 0;
+	// when set, every step's positions get streamed to this file for the benchmark commandlet to replay
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	FString RecordPath;
+	// only steer on the closest few neighbours in range, 0 uses every neighbour in range. quadtree and octree only
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	int32 MaxNeighbours = 0;
+	// quadtree and octree answer the neighbour queries a leaf at a time instead of one traversal per agent
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bGroupQueriesByLeaf = false;
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+	virtual void EndPlay(EEndPlayReason::Type reason) override;
+private:
+	// agents can register before our own BeginPlay ran, so both ends call this
+	void Initialise();
+	void UpdateTree();
+	void QueryNeighbours();
+	// reads Positions and Directions, writes NextPositions and NextDirections and swaps them in at the end
+	void Steer(float deltaTime);
+	// scratch holds the packed neighbours for blended steering, one per task
+	void SteerAgent(int32 agentIndex, float deltaTime, Steering::FNeighbourData& scratch);
+	void PushTransforms();
+	static FVector3f RandomDirection(FRandomStream& stream);
+
+	// agents per ParallelFor task, big enough that scheduling doesn't show up next to the steering
+	static constexpr int32 SteerChunkSize = 256;
+	bool bInitialised = false;
+	ETreeType TreeType = ETreeType::none;
+	AQuadTree* QuadTree = nullptr;
+	AOctree* Octree = nullptr;
+	ASpatialHashGrid* HashGrid = nullptr;
+	FBox WorldBounds;
+	// the largest separation range of any agent, the batch query uses one radius for everyone
+	float QueryRadius = 0.f;
+
+	UPROPERTY()
+	TArray<AAgent*> Agents;
+	// state as of the start of the step, every agent reads its neighbours from these
+	TArray<FVector3f> Positions;
+	TArray<FVector3f> Directions;
+	TArray<FVector3f> NextPositions;
+	TArray<FVector3f> NextDirections;
+	TArray<float> Speeds;
+	TArray<ESteeringType> SteeringTypes;
+	TArray<float> SeparationRanges;
+	TArray<float> SeparationWeights;
+	TArray<float> AlignmentWeights;
+	TArray<float> CohesionWeights;
+	// handle of agent i in the tree or grid, and the way back. handles of actors that aren't ours map to INDEX_NONE
+	TArray<int32> AgentHandles;
+	TArray<int32> HandleAgents;
+	// neighbours of agent i as agent indices, INDEX_NONE for neighbours that aren't ours
+	TNeighbourBuffer<int32> Neighbours;
+	TArray<FTransform> InstanceTransforms;
+	FTrajectoryWriter Recorder;
+	bool bRecordingFailed = false;
+
+	int32 StepCount = 0;
+	// one sample per step and phase, logged as percentiles at EndPlay
+	FLatencyHistogram UpdateLatency;
+	FLatencyHistogram QueryLatency;
+	FLatencyHistogram SteerLatency;
+	FLatencyHistogram TransformLatency;
+};
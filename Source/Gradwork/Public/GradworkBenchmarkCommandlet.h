@@ -0,0 +1,110 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "Gradwork/GradworkGameMode.h"
+#include "Trajectory.h"
+#include "GradworkStats.h"
+#include "GradworkBenchmarkCommandlet.generated.h"
+
+// how the agents get spread over the world bounds
+enum class EBenchmarkDistribution : uint8
+{
+	Uniform,
+	// gaussian blobs around a handful of centres
+	Clustered,
+	// uniform on XY, a thin slab in Z
+	Planar
+};
+
+// node limits handed to the structure before it is built, INDEX_NONE and 0 keep the structure's own defaults
+struct FGradworkBenchmarkConfig
+{
+	int32 MaxDepth = INDEX_NONE;
+	int32 MaxActorsPerNode = INDEX_NONE;
+	float CellSize = 0.f;
+};
+
+// timings of one structure over one run, build and insert are one sample each, the step phases one sample per step
+struct FGradworkBenchmarkResult
+{
+	ETreeType TreeType = ETreeType::none;
+	FGradworkBenchmarkConfig Config;
+	FLatencyHistogram Build;
+	FLatencyHistogram Insert;
+	FLatencyHistogram Update;
+	FLatencyHistogram Query;
+	FLatencyHistogram Steer;
+	int32 NodeCount = 0;
+	double AverageNeighbours = 0.0;
+	double BytesPerAgent = 0.0;
+
+	// mean milliseconds per step
+	double GetStepTime() const { return Update.GetMeanMs() + Query.GetMeanMs() + Steer.GetMeanMs(); }
+	// simulated agents per second of update, query and steer
+	double GetThroughput(int32 numAgents) const { return GetStepTime() > 0.0 ? numAgents / (GetStepTime() / 1000.0) : 0.0; }
+};
+
+// Headless comparison of every ETreeType on the same procedurally spawned agents.
+// UnrealEditor-Cmd Gradwork.uproject -run=GradworkBenchmark -nullrhi [-agents=2000] [-steps=100] [-radius=300]
+//     [-extent=5000] [-seed=0] [-types=quadtree,octree] [-distribution=uniform] [-out=path.csv]
+// -sweep runs every structure in every node limit configuration over -counts=1000,5000,... and every distribution,
+// and writes the full results to -out plus the fastest configuration per scenario next to it.
+// -batchinsert inserts the agents into the quadtree and octree as one batch instead of one by one.
+// -record=path.gwtr saves the motion of the first structure's run, -replay=path.gwtr runs every structure on a recorded
+// motion instead of steering, which leaves only build, update and query in the numbers.
+UCLASS()
+class GRADWORK_API UGradworkBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UGradworkBenchmarkCommandlet();
+	virtual int32 Main(const FString& params) override;
+
+private:
+	int32 RunComparison(UWorld* world, TArrayView<const ETreeType> treeTypes, EBenchmarkDistribution distribution, const FString& outPath);
+	int32 RunReplay(UWorld* world, TArrayView<const ETreeType> treeTypes, const FString& replayPath, const FString& outPath);
+	int32 RunSweep(UWorld* world, TArrayView<const ETreeType> treeTypes, const FString& params, const FString& outPath);
+	// every node limit combination worth trying for the structure
+	TArray<FGradworkBenchmarkConfig> GetSweepConfigs(ETreeType treeType) const;
+	// spawns agents until there are at least numAgents and gives the first numAgents their start state
+	void PrepareAgents(UWorld* world, int32 numAgents, EBenchmarkDistribution distribution);
+	void SpawnAgents(UWorld* world, int32 numAgents);
+	FGradworkBenchmarkResult RunTreeType(UWorld* world, ETreeType treeType, const FGradworkBenchmarkConfig& config);
+	// runs one query per agent, leaves the neighbours of agent i in Neighbours[i]
+	void QueryAll(ETreeType treeType, AActor* structure);
+	// turns the query results into agent indices, NeighbourIndices[i] lists the neighbours of agent i
+	void ResolveNeighbours();
+	// double buffered weighted steering over the query results, writes the new positions back to the actors
+	void SteerAll(FRandomStream& stream);
+	// moves every agent to where the replay has it in that frame
+	void AdvanceReplay(int32 frame);
+	int32 CountNodes(ETreeType treeType, AActor* structure) const;
+	SIZE_T GetAllocatedSize(ETreeType treeType, AActor* structure) const;
+
+	int32 NumAgents = 2000;
+	int32 NumSteps = 100;
+	float QueryRadius = 300.f;
+	int32 Seed = 0;
+	// -batchinsert, the quadtree and octree take the initial agents through InsertBatch
+	bool bBatchInsert = false;
+	FBox WorldBounds;
+	// spawned once and reused, a run only uses the first NumAgents
+	TArray<AActor*> Agents;
+	TMap<AActor*, int32> AgentIndices;
+	TArray<FVector3f> StartPositions;
+	TArray<FVector3f> StartDirections;
+	TArray<FVector3f> Positions;
+	TArray<FVector3f> Directions;
+	TArray<FVector3f> NextPositions;
+	TArray<FVector3f> NextDirections;
+	TArray<TArray<AActor*>> Neighbours;
+	TArray<TArray<int32>> NeighbourIndices;
+	int64 TotalNeighbours = 0;
+	// set while a run is recorded or replayed
+	FTrajectoryWriter* Recorder = nullptr;
+	const FTrajectoryReader* Replay = nullptr;
+};
@@ -0,0 +1,167 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Stats/Stats.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+// everything the spatial structures time shows up under "stat Gradwork"
+DECLARE_STATS_GROUP(TEXT("Gradwork"), STATGROUP_Gradwork, STATCAT_Advanced);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Query"), STAT_GradworkQuery, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Query Batch"), STAT_GradworkQueryBatch, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Insert"), STAT_GradworkInsert, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Remove"), STAT_GradworkRemove, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Update"), STAT_GradworkUpdate, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Subdivide"), STAT_GradworkSubdivide, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Collapse"), STAT_GradworkCollapse, STATGROUP_Gradwork, GRADWORK_API);
+// the phases of one simulation step, around the structure calls above
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step Update"), STAT_GradworkStepUpdate, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step Query"), STAT_GradworkStepQuery, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step Steer"), STAT_GradworkStepSteer, STATGROUP_Gradwork, GRADWORK_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Step Transform"), STAT_GradworkStepTransform, STATGROUP_Gradwork, GRADWORK_API);
+
+CSV_DECLARE_CATEGORY_MODULE_EXTERN(GRADWORK_API, Gradwork);
+
+// Log-linear latency histogram in the spirit of HdrHistogram. Samples are raw cycle counts, exact below
+// LinearCount, above that every power of two is split into SubBucketCount buckets so a percentile is never
+// off by more than about 6%. Fixed size, recording is a bit scan and an increment. Not thread safe.
+struct GRADWORK_API FLatencyHistogram
+{
+	static constexpr int32 SubBucketBits = 4;
+	static constexpr int32 SubBucketCount = 1 << SubBucketBits;
+	static constexpr int32 LinearCount = SubBucketCount * 2;
+	static constexpr int32 BucketCount = LinearCount + (64 - SubBucketBits - 1) * SubBucketCount;
+
+	void Record(uint64 cycles)
+	{
+		++Counts[GetBucket(cycles)];
+		++Count;
+		TotalCycles += cycles;
+		MaxCycles = FMath::Max(MaxCycles, cycles);
+		++FrameCount;
+		FrameCycles += cycles;
+		FrameMaxCycles = FMath::Max(FrameMaxCycles, cycles);
+	}
+	// cycles at or below which percentile (0-100) of the samples fall
+	uint64 GetPercentile(double percentile) const;
+	double GetPercentileMs(double percentile) const { return FPlatformTime::ToMilliseconds64(GetPercentile(percentile)); }
+	double GetMeanMs() const { return Count > 0 ? FPlatformTime::ToMilliseconds64(TotalCycles) / double(Count) : 0.0; }
+	double GetMaxMs() const { return FPlatformTime::ToMilliseconds64(MaxCycles); }
+	uint64 GetCount() const { return Count; }
+	// one line with the mean, p50, p95, p99 and max, nothing when there are no samples
+	void Log(const TCHAR* owner, const TCHAR* operation) const;
+	void Reset();
+	// forgets the per frame totals, the histogram itself keeps everything since the last Reset
+	void ResetFrame()
+	{
+		FrameCount = 0;
+		FrameCycles = 0;
+		FrameMaxCycles = 0;
+	}
+
+	static int32 GetBucket(uint64 cycles)
+	{
+		if (cycles < LinearCount)
+		{
+			return int32(cycles);
+		}
+		// the top SubBucketBits + 1 bits pick the bucket within the power of two
+		const int32 exponent = int32(FPlatformMath::FloorLog2_64(cycles));
+		const int32 shift = exponent - SubBucketBits;
+		return LinearCount + (exponent - SubBucketBits - 1) * SubBucketCount + int32(cycles >> shift) - SubBucketCount;
+	}
+	// middle of the range of cycles the bucket covers
+	static uint64 GetBucketValue(int32 bucket);
+
+	uint32 Counts[BucketCount] = {};
+	uint64 Count = 0;
+	uint64 TotalCycles = 0;
+	uint64 MaxCycles = 0;
+	uint32 FrameCount = 0;
+	uint64 FrameCycles = 0;
+	uint64 FrameMaxCycles = 0;
+};
+
+// one histogram per operation a spatial structure times
+struct GRADWORK_API FGradworkLatencyStats
+{
+	FLatencyHistogram Query;
+	// a whole QueryBatch is one sample, its queries are not timed one by one
+	FLatencyHistogram QueryBatch;
+	FLatencyHistogram Insert;
+	FLatencyHistogram Remove;
+	FLatencyHistogram Update;
+	// a subdivide sample includes redistributing the leaf and any subdivides that cascades into
+	FLatencyHistogram Subdivide;
+	// one sample per merge pass over the whole tree
+	FLatencyHistogram Collapse;
+
+	// percentiles of every operation that saw a sample, owner starts each line
+	void Log(const TCHAR* owner) const;
+	// hands this frame's totals to the csv profiler and starts the next frame
+	void PublishFrame();
+	void Reset();
+};
+
+// Shape and memory of a quadtree or octree at one point in time, see TSpatialTree::GetStats.
+// Gradwork.DumpTree logs it for every tree in the world.
+struct GRADWORK_API FSpatialTreeStats
+{
+	int32 MaxDepth = 0;
+	int32 MaxElementsPerNode = 0;
+	// nodes in use, PooledNodeCount also counts the ones sitting in recycled child blocks
+	int32 NodeCount = 0;
+	int32 PooledNodeCount = 0;
+	int32 FreeBlockCount = 0;
+	int32 LeafCount = 0;
+	int32 EmptyLeafCount = 0;
+	// leaves at MaxDepth holding more than MaxElementsPerNode
+	int32 OverCapacityLeafCount = 0;
+	// nodes one level above MaxDepth whose leaves hold more than MaxElementsPerNode together,
+	// the leaves that would be over capacity with a MaxDepth one lower
+	int32 OverCapacityParentCount = 0;
+	int32 ElementCount = 0;
+	// should always be 0, elements only live in leaves
+	int32 InteriorElementCount = 0;
+	// nodes in use per depth
+	TArray<int32> DepthHistogram;
+	// leaves per element count
+	TArray<int32> LeafOccupancyHistogram;
+	// the same for the leaves at MaxDepth only, the ones a lower MaxDepth would merge
+	TArray<int32> MaxDepthOccupancyHistogram;
+	SIZE_T AllocatedBytes = 0;
+	// capacity of the node pool and of the leaves' element arrays that isn't used
+	SIZE_T SlackBytes = 0;
+	// element arrays recycled nodes hold on to until they are handed out again
+	SIZE_T RecycledBytes = 0;
+
+	void Log(const TCHAR* owner) const;
+};
+
+// Records the cycles between construction and destruction into histogram, a null histogram records nothing.
+// FPlatformTime::Cycles64 is a cycle counter read, cheap enough to wrap around a single small query.
+class FScopedLatency
+{
+public:
+	explicit FScopedLatency(FLatencyHistogram* histogram)
+		: Histogram(histogram)
+		, StartCycles(histogram ? FPlatformTime::Cycles64() : 0)
+	{
+	}
+	~FScopedLatency()
+	{
+		if (Histogram)
+		{
+			Histogram->Record(FPlatformTime::Cycles64() - StartCycles);
+		}
+	}
+private:
+	FLatencyHistogram* Histogram;
+	uint64 StartCycles;
+};
+
+// times the rest of the scope into both the stat and the histogram
+#define GRADWORK_SCOPE_LATENCY(Stat, Histogram) \
+	SCOPE_CYCLE_COUNTER(Stat); \
+	FScopedLatency ANONYMOUS_VARIABLE(GradworkLatency_)(Histogram)
@@ -0,0 +1,88 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/Identity.h"
+
+// Leaf scans over the packed X/Y/Z arrays of a tree leaf or grid cell, four candidates per step.
+// Every step produces a match mask that gets compacted straight into the output array.
+namespace LeafScan
+{
+	template <typename TElement>
+	void AppendMatches(uint32 mask, const TElement* elements, TArray<TElement>& outElements, TIdentity_T<TElement> exclude)
+	{
+		while (mask != 0)
+		{
+			const TElement& element = elements[FMath::CountTrailingZeros(mask)];
+			mask &= mask - 1;
+			if (element != exclude)
+			{
+				outElements.Add(element);
+			}
+		}
+	}
+
+	// appends every element within radius of center, except exclude
+	template <typename TElement>
+	void Sphere(const float* x, const float* y, const float* z, const TElement* elements, int32 num,
+		const FVector3f& center, float radiusSquared, TArray<TElement>& outElements, TIdentity_T<TElement> exclude)
+	{
+		const VectorRegister4Float centerX = VectorSetFloat1(center.X);
+		const VectorRegister4Float centerY = VectorSetFloat1(center.Y);
+		const VectorRegister4Float centerZ = VectorSetFloat1(center.Z);
+		const VectorRegister4Float radius = VectorSetFloat1(radiusSquared);
+		int32 i = 0;
+		for (; i + 4 <= num; i += 4)
+		{
+			const VectorRegister4Float dx = VectorSubtract(VectorLoad(x + i), centerX);
+			const VectorRegister4Float dy = VectorSubtract(VectorLoad(y + i), centerY);
+			const VectorRegister4Float dz = VectorSubtract(VectorLoad(z + i), centerZ);
+			const VectorRegister4Float distanceSquared = VectorMultiplyAdd(dz, dz, VectorMultiplyAdd(dy, dy, VectorMultiply(dx, dx)));
+			AppendMatches(VectorMaskBits(VectorCompareLE(distanceSquared, radius)), elements + i, outElements, exclude);
+		}
+		// leftovers that don't fill a register
+		for (; i < num; ++i)
+		{
+			const float dx = x[i] - center.X;
+			const float dy = y[i] - center.Y;
+			const float dz = z[i] - center.Z;
+			if (dx * dx + dy * dy + dz * dz <= radiusSquared && elements[i] != exclude)
+			{
+				outElements.Add(elements[i]);
+			}
+		}
+	}
+
+	// appends every element within radius of center on the XY plane and less than zTolerance above or below it, except exclude
+	template <typename TElement>
+	void CircleBand(const float* x, const float* y, const float* z, const TElement* elements, int32 num,
+		const FVector3f& center, float radiusSquared, float zTolerance, TArray<TElement>& outElements, TIdentity_T<TElement> exclude)
+	{
+		const VectorRegister4Float centerX = VectorSetFloat1(center.X);
+		const VectorRegister4Float centerY = VectorSetFloat1(center.Y);
+		const VectorRegister4Float centerZ = VectorSetFloat1(center.Z);
+		const VectorRegister4Float radius = VectorSetFloat1(radiusSquared);
+		const VectorRegister4Float tolerance = VectorSetFloat1(zTolerance);
+		int32 i = 0;
+		for (; i + 4 <= num; i += 4)
+		{
+			const VectorRegister4Float dx = VectorSubtract(VectorLoad(x + i), centerX);
+			const VectorRegister4Float dy = VectorSubtract(VectorLoad(y + i), centerY);
+			const VectorRegister4Float dz = VectorAbs(VectorSubtract(VectorLoad(z + i), centerZ));
+			const VectorRegister4Float distanceSquared = VectorMultiplyAdd(dy, dy, VectorMultiply(dx, dx));
+			const VectorRegister4Float match = VectorBitwiseAnd(VectorCompareLE(distanceSquared, radius), VectorCompareLT(dz, tolerance));
+			AppendMatches(VectorMaskBits(match), elements + i, outElements, exclude);
+		}
+		// leftovers that don't fill a register
+		for (; i < num; ++i)
+		{
+			const float dx = x[i] - center.X;
+			const float dy = y[i] - center.Y;
+			if (dx * dx + dy * dy <= radiusSquared && FMath::Abs(z[i] - center.Z) < zTolerance && elements[i] != exclude)
+			{
+				outElements.Add(elements[i]);
+			}
+		}
+	}
+}
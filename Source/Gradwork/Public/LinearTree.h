@@ -0,0 +1,113 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "GradworkStats.h"
+#include "LinearTree.generated.h"
+
+// Morton key of one registered actor, radix sorted on every rebuild
+struct FMortonEntry
+{
+	uint64 Key;
+	int32 ActorIndex;
+};
+
+USTRUCT()
+struct FLinearTreeNode
+{
+	GENERATED_BODY()
+	FBox Bounds;
+	// range of the Morton sorted actor arrays that falls inside this node
+	int32 Begin = 0;
+	int32 End = 0;
+	// only non-empty children are created, ChildCount of them stored next to each other
+	int32 FirstChild = INDEX_NONE;
+	int32 ChildCount = 0;
+	int32 Depth = 0;
+	bool IsLeaf() const { return FirstChild == INDEX_NONE; }
+};
+
+// Octree (or quadtree when planar) stored as a Z-order sorted array and rebuilt from scratch every frame.
+// Nothing is removed or reinserted when actors move, the whole structure is derived from the sorted keys.
+UCLASS()
+class GRADWORK_API ALinearTree : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	// Sets default values for this actor's properties
+	ALinearTree();
+
+	// Called every frame
+	virtual void Tick(float DeltaTime) override;
+	UFUNCTION(BlueprintCallable)
+	void Build(const FBox& bounds);
+	// registers the actor, it gets sorted into place on the next rebuild
+	UFUNCTION(BlueprintCallable)
+	void Insert(AActor* actor);
+	UFUNCTION(BlueprintCallable)
+	void Remove(AActor* actor);
+	UFUNCTION(BlueprintCallable)
+	void Rebuild();
+	UFUNCTION(BlueprintCallable)
+	void Query(const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator);
+	// every actor within radius of center, tested against the positions of the last rebuild. When planar the radius
+	// is measured on the XY plane and only actors within zHeightTolerance of center.Z count, like AQuadTree::QueryCircle
+	UFUNCTION(BlueprintCallable)
+	void QuerySphere(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator);
+
+	bool IsInsideBounds(AActor* actor);
+	bool IsBuilt() const { return bIsBuilt; }
+	int32 GetNumNodes() const { return Nodes.Num(); }
+	SIZE_T GetAllocatedSize() const;
+	// takes effect on the next Rebuild
+	void SetNodeLimits(int32 maxDepth, int32 maxActorsPerNode)
+	{
+		MaxDepth = maxDepth;
+		MaxActorsPerNode = maxActorsPerNode;
+	}
+	FBox GetWorldBounds() const { return WorldBounds; }
+	UPROPERTY(EditAnywhere, Category = "Init")
+	bool bvisualize = false;
+	// interleave only X and Y, which turns the octree into a quadtree
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bPlanar = false;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float zHeightTolerance = 100.f;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	TArray<AActor*> allActors;
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+	virtual void EndPlay(EEndPlayReason::Type reason) override;
+private:
+	void SortEntries();
+	void BuildNode(int32 nodeIndex);
+	void QuerySphereNode(int32 nodeIndex, const FVector& center, float radiusSquared, TArray<AActor*>& outActors, AActor* queryInstigator) const;
+	FBox GetChildBounds(const FBox& bounds, uint64 digit) const;
+	uint64 ComputeKey(const FVector& location) const;
+	int32 GetLevelCount() const;
+	int32 GetDimensions() const { return bPlanar ? 2 : 3; }
+	void VisualiseTree();
+	UPROPERTY(EditAnywhere, Category = "Init")
+	int32 MaxDepth = 10;
+	UPROPERTY(EditAnywhere, Category = "Init")
+	int32 MaxActorsPerNode = 4;
+
+	UPROPERTY(EditAnywhere, Category = "Init")
+	FBox WorldBounds;
+	bool bIsBuilt = false;
+	// index of every registered actor in allActors, so registering is a lookup instead of a scan
+	TMap<AActor*, int32> ActorIndices;
+	TArray<FVector> Positions;
+	TArray<FMortonEntry> Entries;
+	TArray<FMortonEntry> SortScratch;
+	// actors and their positions in Morton order, nodes reference ranges of these
+	TArray<AActor*> SortedActors;
+	TArray<FVector> SortedPositions;
+	TArray<FLinearTreeNode> Nodes;
+	// per operation latency histograms, logged in EndPlay and published to the csv profiler every frame
+	FGradworkLatencyStats Latency;
+};
@@ -0,0 +1,118 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/ParallelFor.h"
+
+// Neighbour lists of a whole batch of queries in one flat buffer, as actors or as element handles.
+// The neighbours of query i are Neighbours[Offsets[i]] up to (not including) Neighbours[Offsets[i + 1]].
+template <typename TElement>
+struct TNeighbourBuffer
+{
+	TArray<int32> Offsets;
+	TArray<TElement> Neighbours;
+
+	int32 NumQueries() const { return FMath::Max(Offsets.Num() - 1, 0); }
+	TArrayView<const TElement> GetNeighbours(int32 queryIndex) const
+	{
+		return TArrayView<const TElement>(Neighbours.GetData() + Offsets[queryIndex], Offsets[queryIndex + 1] - Offsets[queryIndex]);
+	}
+
+	// Runs query(queryIndex, out) for every query on the task graph, each call appends its neighbours to out.
+	// Queries are handed out in contiguous chunks so the result doesn't depend on how the work got scheduled.
+	template <typename QueryFunc>
+	void Fill(int32 numQueries, QueryFunc&& query)
+	{
+		const int32 numChunks = FMath::DivideAndRoundUp(numQueries, ChunkSize);
+		Chunks.SetNum(numChunks);
+		ParallelFor(numChunks, [this, numQueries, &query](int32 chunkIndex)
+		{
+			FChunk& chunk = Chunks[chunkIndex];
+			chunk.Neighbours.Reset();
+			chunk.Counts.Reset();
+			const int32 end = FMath::Min((chunkIndex + 1) * ChunkSize, numQueries);
+			for (int32 queryIndex = chunkIndex * ChunkSize; queryIndex < end; ++queryIndex)
+			{
+				const int32 before = chunk.Neighbours.Num();
+				query(queryIndex, chunk.Neighbours);
+				chunk.Counts.Add(chunk.Neighbours.Num() - before);
+			}
+		});
+
+		Offsets.SetNumUninitialized(numQueries + 1);
+		Offsets[0] = 0;
+		int32 queryIndex = 0;
+		for (const FChunk& chunk : Chunks)
+		{
+			for (int32 count : chunk.Counts)
+			{
+				Offsets[queryIndex + 1] = Offsets[queryIndex] + count;
+				++queryIndex;
+			}
+		}
+		Neighbours.SetNumUninitialized(Offsets[numQueries]);
+		ParallelFor(numChunks, [this](int32 chunkIndex)
+		{
+			const FChunk& chunk = Chunks[chunkIndex];
+			FMemory::Memcpy(Neighbours.GetData() + Offsets[chunkIndex * ChunkSize], chunk.Neighbours.GetData(), chunk.Neighbours.Num() * sizeof(TElement));
+		});
+	}
+
+	// Fill for queries that get answered a group at a time, like every element of one leaf. group(groupIndex, queries,
+	// counts, out) runs once per group on the task graph and appends the index of every query it answered to queries,
+	// the number of neighbours it found for it to counts and those neighbours to out, all in the same order.
+	// Queries that no group answered end up without neighbours.
+	template <typename GroupFunc>
+	void FillGroups(int32 numQueries, int32 numGroups, GroupFunc&& group)
+	{
+		Chunks.SetNum(numGroups);
+		ParallelFor(numGroups, [this, &group](int32 groupIndex)
+		{
+			FChunk& chunk = Chunks[groupIndex];
+			chunk.Neighbours.Reset();
+			chunk.Counts.Reset();
+			chunk.Queries.Reset();
+			group(groupIndex, chunk.Queries, chunk.Counts, chunk.Neighbours);
+		});
+
+		Offsets.Reset();
+		Offsets.SetNumZeroed(numQueries + 1);
+		for (const FChunk& chunk : Chunks)
+		{
+			for (int32 i = 0; i < chunk.Queries.Num(); ++i)
+			{
+				Offsets[chunk.Queries[i] + 1] = chunk.Counts[i];
+			}
+		}
+		for (int32 queryIndex = 0; queryIndex < numQueries; ++queryIndex)
+		{
+			Offsets[queryIndex + 1] += Offsets[queryIndex];
+		}
+		Neighbours.SetNumUninitialized(Offsets[numQueries]);
+		ParallelFor(numGroups, [this](int32 groupIndex)
+		{
+			const FChunk& chunk = Chunks[groupIndex];
+			int32 start = 0;
+			for (int32 i = 0; i < chunk.Queries.Num(); ++i)
+			{
+				FMemory::Memcpy(Neighbours.GetData() + Offsets[chunk.Queries[i]], chunk.Neighbours.GetData() + start, chunk.Counts[i] * sizeof(TElement));
+				start += chunk.Counts[i];
+			}
+		});
+	}
+
+private:
+	static constexpr int32 ChunkSize = 64;
+	// per chunk scratch, kept around so a steady state batch doesn't allocate
+	struct FChunk
+	{
+		TArray<TElement> Neighbours;
+		TArray<int32> Counts;
+		// only used by FillGroups, Fill answers its chunk's queries in order
+		TArray<int32> Queries;
+	};
+	TArray<FChunk> Chunks;
+};
+
+using FNeighbourBuffer = TNeighbourBuffer<AActor*>;
@@ -4,31 +4,12 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "NeighbourBuffer.h"
+#include "SpatialTreeCore.h"
 #include "Octree.generated.h"
 
-USTRUCT()
-struct FOctreeNode
-{
-	GENERATED_BODY()
-	//UPROPERTY()
-	FBox Bounds;
-	//UPROPERTY();
-	TArray<AActor*> Actors;
-	//UPROPERTY();
-	TArray<TSharedPtr<FOctreeNode>> Children;
-	TSharedPtr<FOctreeNode> Parent;
-	int32 Depth;
-	FOctreeNode() = default;
-	FOctreeNode(const FBox& bounds) : Bounds(bounds)
-	{
-		Depth = 0;
-	}
-	~FOctreeNode()
-	{
-		GEngine->AddOnScreenDebugMessage(-1, 1.f, FColor::Red, TEXT("Octree node destroyed"));
-	}
-	bool IsLeaf() const { return Children.IsEmpty(); };
-};
+using FOctreeNode = TSpatialTreeNode<3, AActor*>;
+using FOctreeCore = TSpatialTreeCore<3, AActor*>;
 UCLASS()
 class GRADWORK_API AOctree : public AActor
 {
@@ -40,17 +21,76 @@ public:
 
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
-	TSharedPtr<FOctreeNode> root;
+	static constexpr int32 ChildCount = FOctreeCore::ChildCount;
+	static constexpr int32 RootIndex = FOctreeCore::RootIndex;
+	// node pool, the root is always at RootIndex
+	const TArray<FOctreeNode>& GetNodes() const { return Core.GetTree().GetNodes(); }
 	UFUNCTION(BlueprintCallable)
 	void Build(const FBox& bounds);
 	UFUNCTION(BlueprintCallable)
 	void Insert(AActor* actor);
+	// Insert for a whole spawn wave at once, the subtrees below the leaves it lands in are built in parallel
+	void InsertBatch(TArrayView<AActor* const> actors);
 	UFUNCTION(BlueprintCallable)
 	void Query(const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator);
+	// every actor within radius of center, across leaf boundaries
+	UFUNCTION(BlueprintCallable)
+	void QuerySphere(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator);
+	UFUNCTION(BlueprintCallable)
+	void QueryBox(const FBox& box, TArray<AActor*>& outActors, AActor* queryInstigator);
+	// the k closest actors within maxRadius, appended nearest first
+	UFUNCTION(BlueprintCallable)
+	void QueryKNearest(const FVector& location, int32 k, float maxRadius, TArray<AActor*>& outActors, AActor* queryInstigator);
+	// Runs a radius query (or a k-nearest query when k > 0) for every location in parallel and writes all
+	// results into one flat buffer. instigators[i], when given, is left out of the neighbours of query i.
+	// The tree must not be modified while this runs.
+	void QueryBatch(TArrayView<const FVector> locations, float radius, int32 k, FNeighbourBuffer& outNeighbours, TArrayView<AActor* const> instigators = TArrayView<AActor* const>());
+	// same as QueryBatch but the neighbours come back as handles, excludeHandles[i] is left out of query i
+	void QueryBatchHandles(TArrayView<const FVector3f> locations, float radius, int32 k, TNeighbourBuffer<int32>& outNeighbours, TArrayView<const int32> excludeHandles);
+	// QueryBatchHandles for every actor in the tree at once, grouped by leaf: the actor with handle h is query
+	// queryIndicesByHandle[h] and is measured from where the last update saw it
+	void QueryBatchByLeaf(float radius, int32 k, int32 numQueries, TArrayView<const int32> queryIndicesByHandle, TNeighbourBuffer<int32>& outNeighbours);
 	UFUNCTION(BlueprintCallable)
 	void ClearTree(bool rebuild);
 
-	void RemoveActorFromNode(TSharedPtr<FOctreeNode> node, AActor* actor);
+	void RemoveActorFromNode(int32 nodeIndex, AActor* actor);
+	// Moves every actor that left its leaf since the last update, reinserting it from the lowest ancestor
+	// that still contains it, then collapses subtrees that ended up empty. Runs once per frame from Tick.
+	UFUNCTION(BlueprintCallable)
+	void UpdateAll();
+	// UpdateAll without touching actor transforms: the actor with handle h is at positions[indicesByHandle[h]].
+	// Handles without an index fall back to the actor location.
+	void UpdateFromPositions(TArrayView<const FVector3f> positions, TArrayView<const int32> indicesByHandle);
+	// off while an AAgentSimulation drives the tree through UpdateFromPositions
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bUpdateInTick = true;
+	// retunes MaxDepth and MaxActorsPerNode every AdaptInterval seconds from the measured costs and leaf occupancy
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bAdaptiveLimits = false;
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	float AdaptInterval = 1.f;
+	// Rebuilds the tree on a worker from a snapshot of the positions while queries read the one built from the
+	// previous snapshot, the two swap at the next update. Queries see the positions one frame late.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bAsyncRebuild = false;
+	// Queries made for an actor in the tree start at its leaf and climb only until the query region fits, instead of
+	// descending from the root. Same results either way, agents that barely moved skip the upper levels.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bCoherentQueries = true;
+	// returns nullptr for indices that are out of range or point at a recycled node
+	const FOctreeNode* FindNode(int32 nodeIndex) const { return Core.GetTree().FindNode(nodeIndex); }
+	// handle the tree stores next to the actor in its leaf, assigned on first insert
+	int32 GetHandle(AActor* actor) { return Core.GetHandle(actor); }
+	AActor* GetElement(int32 handle) const { return Core.GetTree().GetElement(handle); }
+	SIZE_T GetAllocatedSize() const { return Core.GetAllocatedSize(); }
+	// node counts, depth and occupancy histograms and memory, what Gradwork.DumpTree logs
+	FSpatialTreeStats GetTreeStats() const { return Core.GetTree().GetStats(); }
+	// takes effect on the next Build or UpdateAll
+	void SetNodeLimits(int32 maxDepth, int32 maxActorsPerNode)
+	{
+		MaxDepth = maxDepth;
+		MaxActorsPerNode = maxActorsPerNode;
+	}
 	UPROPERTY(EditAnywhere, BlueprintReadWrite,Category = "Init")
 	float TreeHeight = 100.f;
 	UPROPERTY(EditAnywhere, Category = "Init")
@@ -64,23 +104,22 @@ protected:
 	virtual void BeginPlay() override;
 	virtual void EndPlay(EEndPlayReason::Type reason) override;
 private:	
-	void Subdivide(TSharedPtr<FOctreeNode> node);
-	void InsertNode(TSharedPtr<FOctreeNode>& node, AActor* actor);
-	void QueryNode(TSharedPtr<FOctreeNode> node, const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator);
-	void VisualiseNode(UWorld* world, TSharedPtr<FOctreeNode> node, const FColor& color = FColor::Green)const;
+	// pushes the editable settings into the core, they only take effect at Build and UpdateAll
+	void ApplySettings();
+	void VisualiseNode(UWorld* world, int32 nodeIndex, const FColor& color = FColor::Green)const;
 	void VisualiseTree();
-	void ClearNode(TSharedPtr<FOctreeNode>& node, TSharedPtr<FOctreeNode>& previous, TArray<TSharedPtr<FOctreeNode>>& parents);
 	UPROPERTY(EditAnywhere, Category = "Init")
 	int32 MaxDepth = 4;
 	UPROPERTY(EditAnywhere, Category = "Init")
 	int32 MaxActorsPerNode = 4;
+	// a subtree merges back into one leaf once it holds no more than this share of MaxActorsPerNode
+	UPROPERTY(EditAnywhere, Category = "Init")
+	float MergeRatio = 0.5f;
+	// frames between merge passes
+	UPROPERTY(EditAnywhere, Category = "Init")
+	int32 MaintenanceInterval = 8;
 
 	UPROPERTY(EditAnywhere, Category = "Init")
 	FBox WorldBounds;
-	bool bIsBuilt = false;
-	TArray<TSharedPtr<FOctreeNode>> Parents;
-	int32 QueryCount;
-	double TotalQueryTime;
-	int32 InsertCount;
-	double TotalInsertTime;
+	FOctreeCore Core;
 };
@@ -0,0 +1,147 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "GradworkStats.h"
+#include "NeighbourBuffer.h"
+#include "SpatialHashGrid.generated.h"
+
+// one cell of the grid, the packed positions are refreshed once per frame in UpdateAll
+struct FGridCell
+{
+	TArray<AActor*> Actors;
+	TArray<float> X;
+	TArray<float> Y;
+	TArray<float> Z;
+	// index of Actors[i] in the grid's Elements
+	TArray<int32> Handles;
+
+	int32 Num() const { return Actors.Num(); }
+	SIZE_T GetAllocatedSize() const
+	{
+		return Actors.GetAllocatedSize() + X.GetAllocatedSize() + Y.GetAllocatedSize() + Z.GetAllocatedSize() + Handles.GetAllocatedSize();
+	}
+	void AddElement(AActor* actor, const FVector3f& position, int32 handle)
+	{
+		Actors.Add(actor);
+		X.Add(position.X);
+		Y.Add(position.Y);
+		Z.Add(position.Z);
+		Handles.Add(handle);
+	}
+	void RemoveElementAtSwap(int32 index)
+	{
+		Actors.RemoveAtSwap(index, 1, false);
+		X.RemoveAtSwap(index, 1, false);
+		Y.RemoveAtSwap(index, 1, false);
+		Z.RemoveAtSwap(index, 1, false);
+		Handles.RemoveAtSwap(index, 1, false);
+	}
+};
+
+// Uniform grid over the world bounds where only occupied cells exist, found through an open addressed hash of
+// their coordinates. Moving an actor to another cell is a swap remove and an add, no matter how many actors there are.
+UCLASS()
+class GRADWORK_API ASpatialHashGrid : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	// Sets default values for this actor's properties
+	ASpatialHashGrid();
+
+	// Called every frame
+	virtual void Tick(float DeltaTime) override;
+	UFUNCTION(BlueprintCallable)
+	void Build(const FBox& bounds);
+	UFUNCTION(BlueprintCallable)
+	void Insert(AActor* actor);
+	UFUNCTION(BlueprintCallable)
+	void Remove(AActor* actor);
+	// every actor in the cell that contains queryLocation
+	UFUNCTION(BlueprintCallable)
+	void Query(const FVector& queryLocation, TArray<AActor*>& outActors, AActor* queryInstigator);
+	// every actor within radius of center, tested against the positions of the last UpdateAll
+	UFUNCTION(BlueprintCallable)
+	void QuerySphere(const FVector& center, float radius, TArray<AActor*>& outActors, AActor* queryInstigator);
+	// moves every actor whose cell changed since the last call and refreshes the stored positions
+	UFUNCTION(BlueprintCallable)
+	void UpdateAll();
+	// UpdateAll without touching actor transforms: the actor with handle h is at positions[indicesByHandle[h]].
+	// Handles without an index fall back to the actor location.
+	void UpdateFromPositions(TArrayView<const FVector3f> positions, TArrayView<const int32> indicesByHandle);
+	// a sphere query per location in parallel, the neighbours come back as handles and excludeHandles[i] is left out of query i.
+	// The grid must not be modified while this runs.
+	void QueryBatchHandles(TArrayView<const FVector3f> locations, float radius, TNeighbourBuffer<int32>& outNeighbours, TArrayView<const int32> excludeHandles);
+	// handle the grid stores next to the actor in its cell, assigned on first use like the trees do
+	int32 GetHandle(AActor* actor);
+	// GetHandle without assigning one, INDEX_NONE for actors the grid has never seen
+	int32 FindHandle(AActor* actor) const
+	{
+		const int32* handle = ElementHandles.Find(actor);
+		return handle ? *handle : INDEX_NONE;
+	}
+	AActor* GetElement(int32 handle) const { return Elements.IsValidIndex(handle) ? Elements[handle] : nullptr; }
+
+	bool IsInsideBounds(AActor* actor);
+	bool IsBuilt() const { return bIsBuilt; }
+	// cells that hold actors, plus the ones emptied since the last UpdateAll
+	int32 GetNumCells() const { return Cells.Num(); }
+	SIZE_T GetAllocatedSize() const;
+	FBox GetWorldBounds() const { return WorldBounds; }
+	UPROPERTY(EditAnywhere, Category = "Init")
+	bool bvisualize = false;
+	// edge length of a cell, a query radius close to this touches at most 27 cells
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	float CellSize = 300.f;
+	// off while an AAgentSimulation drives the grid through UpdateFromPositions
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Init")
+	bool bUpdateInTick = true;
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+	virtual void EndPlay(EEndPlayReason::Type reason) override;
+private:
+	FIntVector GetCellCoordinates(const FVector& location) const;
+	int32 GetCellKey(const FIntVector& coordinates) const { return coordinates.X + CellCounts.X * (coordinates.Y + CellCounts.Y * coordinates.Z); }
+	int32 GetCellKey(const FVector& location) const { return GetCellKey(GetCellCoordinates(location)); }
+	FIntVector GetKeyCoordinates(int32 key) const { return FIntVector(key % CellCounts.X, (key / CellCounts.X) % CellCounts.Y, key / (CellCounts.X * CellCounts.Y)); }
+	FBox GetCellBounds(const FIntVector& coordinates) const;
+	// index into Cells of the cell with this key, INDEX_NONE when nobody is in it
+	int32 FindCell(int32 key) const;
+	int32 FindOrAddCell(int32 key);
+	// sizes the table for the cells there are and puts every key back in
+	void RehashCells();
+	// drops the cells UpdateAll left empty once they outnumber the occupied ones
+	void ReleaseEmptyCells();
+	void VisualiseGrid();
+	template <typename PositionFunc>
+	void UpdateCells(PositionFunc&& getPosition);
+	// items picks what gets reported per match, the actors themselves or their handles
+	template <typename TItem>
+	void QuerySphereCells(const FVector3f& center, float radius, TArray<TItem>& outItems, TItem exclude, TArray<TItem> FGridCell::* items) const;
+	// Only occupied cells take memory, this just keeps the cell keys X + Y * X + Z * X * Y inside an int32.
+	UPROPERTY(EditAnywhere, Category = "Init", meta = (ClampMin = 1, ClampMax = 1024))
+	int32 MaxCellsPerAxis = 1024;
+
+	UPROPERTY(EditAnywhere, Category = "Init")
+	FBox WorldBounds;
+	bool bIsBuilt = false;
+	FIntVector CellCounts = FIntVector(1, 1, 1);
+	FVector InvCellSize = FVector::OneVector;
+	// the occupied cells and their keys, in no particular order
+	TArray<FGridCell> Cells;
+	TArray<int32> CellKeys;
+	// Open addressed with linear probing, a power of two at most half full. Buckets hold an index into Cells or
+	// INDEX_NONE. Nothing is ever removed from it, ReleaseEmptyCells rebuilds it instead.
+	TArray<int32> CellTable;
+	uint32 CellTableShift = 32;
+	// every actor that has been inserted, indexed by handle, together with the index of its cell
+	TArray<AActor*> Elements;
+	TArray<int32> ElementCells;
+	TMap<AActor*, int32> ElementHandles;
+	// per operation latency histograms, logged in EndPlay and published to the csv profiler every frame
+	FGradworkLatencyStats Latency;
+};
@@ -0,0 +1,1270 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/ParallelFor.h"
+#include "LeafScan.h"
+#include "NeighbourBuffer.h"
+#include "GradworkStats.h"
+
+// the parts that differ between the quadtree and the octree, everything else in TSpatialTree is shared
+template <int32 Dim>
+struct TSpatialTreeTraits;
+
+template <>
+struct TSpatialTreeTraits<2>
+{
+	using FBoundsType = FBox2D;
+	using FVectorType = FVector2D;
+	static FBoundsType MakeBounds(const FBox& box) { return FBox2D(FVector2D(box.Min), FVector2D(box.Max)); }
+	static FVectorType ToVector(const FVector3f& position) { return FVector2D(position.X, position.Y); }
+};
+
+template <>
+struct TSpatialTreeTraits<3>
+{
+	using FBoundsType = FBox;
+	using FVectorType = FVector;
+	static FBoundsType MakeBounds(const FBox& box) { return box; }
+	static FVectorType ToVector(const FVector3f& position) { return FVector(position); }
+};
+
+template <int32 Dim, typename TElement>
+struct TSpatialTreeNode
+{
+	using FBoundsType = typename TSpatialTreeTraits<Dim>::FBoundsType;
+
+	FBoundsType Bounds;
+	TArray<TElement> Elements;
+	// packed copy of the element positions as of the last UpdateAll, entry i belongs to Elements[i].
+	// the quadtree only splits XY but Z is kept for the height band
+	TArray<float> X;
+	TArray<float> Y;
+	TArray<float> Z;
+	// index of Elements[i] in the tree's handle table
+	TArray<int32> Handles;
+	// children live in the node pool as one contiguous block, starting at this index
+	int32 FirstChild = INDEX_NONE;
+	int32 Parent = INDEX_NONE;
+	int32 Depth = 0;
+	// false while the node sits in a recycled child block
+	bool bInUse = false;
+
+	bool IsLeaf() const { return FirstChild == INDEX_NONE; }
+	int32 Num() const { return Elements.Num(); }
+	FVector3f GetPosition(int32 index) const { return FVector3f(X[index], Y[index], Z[index]); }
+	void AddElement(TElement element, const FVector3f& position, int32 handle)
+	{
+		Elements.Add(element);
+		X.Add(position.X);
+		Y.Add(position.Y);
+		Z.Add(position.Z);
+		Handles.Add(handle);
+	}
+	void RemoveElementAtSwap(int32 index)
+	{
+		Elements.RemoveAtSwap(index, 1, false);
+		X.RemoveAtSwap(index, 1, false);
+		Y.RemoveAtSwap(index, 1, false);
+		Z.RemoveAtSwap(index, 1, false);
+		Handles.RemoveAtSwap(index, 1, false);
+	}
+	// Reset keeps the allocations around for the next time this node gets handed out
+	SIZE_T GetAllocatedSize() const
+	{
+		return Elements.GetAllocatedSize() + X.GetAllocatedSize() + Y.GetAllocatedSize() + Z.GetAllocatedSize() + Handles.GetAllocatedSize();
+	}
+	// the part of GetAllocatedSize past the last element
+	SIZE_T GetSlackSize() const
+	{
+		return Elements.GetSlack() * sizeof(TElement) + (X.GetSlack() + Y.GetSlack() + Z.GetSlack()) * sizeof(float) + Handles.GetSlack() * sizeof(int32);
+	}
+	void ResetElements()
+	{
+		Elements.Reset();
+		X.Reset();
+		Y.Reset();
+		Z.Reset();
+		Handles.Reset();
+	}
+};
+
+// Pooled quadtree (Dim 2) or octree (Dim 3) over packed element positions.
+// AQuadTree and AOctree wrap one of these, timing and visualisation stay in the actors.
+template <int32 Dim, typename TElement>
+class TSpatialTree
+{
+	static_assert(Dim == 2 || Dim == 3, "TSpatialTree is either a quadtree or an octree");
+public:
+	using FTraits = TSpatialTreeTraits<Dim>;
+	using FBoundsType = typename FTraits::FBoundsType;
+	using FVectorType = typename FTraits::FVectorType;
+	using FNode = TSpatialTreeNode<Dim, TElement>;
+	static constexpr int32 ChildCount = 1 << Dim;
+	static constexpr int32 RootIndex = 0;
+
+	int32 MaxDepth = 4;
+	// a leaf splits once it holds more than MaxElementsPerNode
+	int32 MaxElementsPerNode = 4;
+	// A subtree merges back into one leaf once it holds no more than this share of MaxElementsPerNode. Kept below
+	// 1 so an element going back and forth across a boundary doesn't split and merge the same node every frame.
+	float MergeRatio = 0.5f;
+	// UpdateAll runs the merge pass every this many calls, in between emptied nodes just stay around
+	int32 MaintenanceInterval = 8;
+	// only used by the quadtree, Z isn't split so radius and k-nearest queries keep a band around the query height
+	float ZTolerance = 100.f;
+	// called whenever an element lands in a leaf, and with INDEX_NONE when it drops out of the tree
+	TFunction<void(TElement, int32)> OnLeafAssigned;
+	// subdivides and collapses get timed into this when it is set, the owner keeps it alive
+	FGradworkLatencyStats* Latency = nullptr;
+
+	void Build(const FBox& bounds)
+	{
+		Nodes.Reset();
+		FreeChildBlocks.Reset();
+		UpdatesSinceMaintenance = 0;
+		FNode& root = Nodes.AddDefaulted_GetRef();
+		root.Bounds = FTraits::MakeBounds(bounds);
+		root.bInUse = true;
+	}
+
+	// drops every node and every handle, every element that was in a leaf hears it dropped out of the tree
+	void Reset()
+	{
+		if (OnLeafAssigned)
+		{
+			for (int32 handle = 0; handle < ElementsByHandle.Num(); ++handle)
+			{
+				if (LeavesByHandle[handle] != INDEX_NONE)
+				{
+					OnLeafAssigned(ElementsByHandle[handle], INDEX_NONE);
+				}
+			}
+		}
+		UpdatesSinceMaintenance = 0;
+		Nodes.Empty();
+		FreeChildBlocks.Empty();
+		ElementsByHandle.Empty();
+		HandlesByElement.Empty();
+		LeavesByHandle.Empty();
+	}
+
+	bool IsBuilt() const { return !Nodes.IsEmpty(); }
+	// heap memory held by the tree, including the pooled nodes that are currently unused
+	SIZE_T GetAllocatedSize() const
+	{
+		SIZE_T size = Nodes.GetAllocatedSize() + FreeChildBlocks.GetAllocatedSize() + ElementsByHandle.GetAllocatedSize()
+			+ HandlesByElement.GetAllocatedSize() + LeavesByHandle.GetAllocatedSize() + MovedElements.GetAllocatedSize();
+		for (const FNode& node : Nodes)
+		{
+			size += node.GetAllocatedSize();
+		}
+		return size;
+	}
+	// one pass over the node pool, recycled nodes included
+	FSpatialTreeStats GetStats() const
+	{
+		FSpatialTreeStats stats;
+		stats.MaxDepth = MaxDepth;
+		stats.MaxElementsPerNode = MaxElementsPerNode;
+		stats.PooledNodeCount = Nodes.Num();
+		stats.FreeBlockCount = FreeChildBlocks.Num();
+		stats.AllocatedBytes = GetAllocatedSize();
+		stats.SlackBytes = Nodes.GetSlack() * sizeof(FNode);
+		for (const FNode& node : Nodes)
+		{
+			if (!node.bInUse)
+			{
+				stats.RecycledBytes += node.GetAllocatedSize();
+				continue;
+			}
+			++stats.NodeCount;
+			stats.SlackBytes += node.GetSlackSize();
+			if (stats.DepthHistogram.Num() <= node.Depth)
+			{
+				stats.DepthHistogram.SetNumZeroed(node.Depth + 1);
+			}
+			++stats.DepthHistogram[node.Depth];
+			const int32 num = node.Num();
+			if (!node.IsLeaf())
+			{
+				stats.InteriorElementCount += num;
+				if (node.Depth == MaxDepth - 1)
+				{
+					int32 below = 0;
+					for (int32 i = 0; i < ChildCount; ++i)
+					{
+						below += Nodes[node.FirstChild + i].Num();
+					}
+					stats.OverCapacityParentCount += below > MaxElementsPerNode ? 1 : 0;
+				}
+				continue;
+			}
+			++stats.LeafCount;
+			stats.ElementCount += num;
+			stats.EmptyLeafCount += num == 0 ? 1 : 0;
+			stats.OverCapacityLeafCount += node.Depth >= MaxDepth && num > MaxElementsPerNode ? 1 : 0;
+			if (stats.LeafOccupancyHistogram.Num() <= num)
+			{
+				stats.LeafOccupancyHistogram.SetNumZeroed(num + 1);
+			}
+			++stats.LeafOccupancyHistogram[num];
+			if (node.Depth >= MaxDepth)
+			{
+				if (stats.MaxDepthOccupancyHistogram.Num() <= num)
+				{
+					stats.MaxDepthOccupancyHistogram.SetNumZeroed(num + 1);
+				}
+				++stats.MaxDepthOccupancyHistogram[num];
+			}
+		}
+		return stats;
+	}
+	const TArray<FNode>& GetNodes() const { return Nodes; }
+	// returns nullptr for indices that are out of range or point at a recycled node
+	const FNode* FindNode(int32 nodeIndex) const
+	{
+		if (!Nodes.IsValidIndex(nodeIndex) || !Nodes[nodeIndex].bInUse)
+		{
+			return nullptr;
+		}
+		return &Nodes[nodeIndex];
+	}
+
+	// handle the tree stores next to the element in its leaf, assigned on first insert
+	int32 GetHandle(TElement element)
+	{
+		if (const int32* handle = HandlesByElement.Find(element))
+		{
+			return *handle;
+		}
+		const int32 handle = ElementsByHandle.Add(element);
+		HandlesByElement.Add(element, handle);
+		LeavesByHandle.Add(INDEX_NONE);
+		return handle;
+	}
+	// GetHandle without handing out a new one, INDEX_NONE for elements that were never inserted
+	int32 FindHandle(TElement element) const
+	{
+		const int32* handle = HandlesByElement.Find(element);
+		return handle ? *handle : INDEX_NONE;
+	}
+	TElement GetElement(int32 handle) const { return ElementsByHandle.IsValidIndex(handle) ? ElementsByHandle[handle] : TElement(); }
+	int32 GetNumHandles() const { return ElementsByHandle.Num(); }
+	// leaf the element with this handle is stored in, INDEX_NONE while it isn't in the tree
+	int32 GetLeaf(int32 handle) const { return LeavesByHandle.IsValidIndex(handle) ? LeavesByHandle[handle] : INDEX_NONE; }
+
+	// Drops every node and rebuilds from a snapshot taken with GetNumHandles/GetElement/GetLeaf: elements[h] keeps
+	// handle h and is inserted at positions[h] when bInTree[h]. Only touches this tree, so it can run on a worker
+	// while another tree answers the queries, as long as OnLeafAssigned and Latency are left unset.
+	void BuildFrom(const FBox& bounds, TArrayView<const TElement> elements, TArrayView<const FVector3f> positions, TArrayView<const bool> bInTree)
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTree_BuildFrom)
+		Build(bounds);
+		ElementsByHandle.Reset();
+		ElementsByHandle.Append(elements.GetData(), elements.Num());
+		HandlesByElement.Reset();
+		LeavesByHandle.Init(INDEX_NONE, elements.Num());
+		for (int32 handle = 0; handle < elements.Num(); ++handle)
+		{
+			HandlesByElement.Add(elements[handle], handle);
+			if (bInTree[handle] && Contains(Nodes[RootIndex].Bounds, positions[handle]))
+			{
+				InsertNode(RootIndex, elements[handle], positions[handle], handle);
+			}
+		}
+	}
+
+	void CopySettings(const TSpatialTree& other)
+	{
+		MaxDepth = other.MaxDepth;
+		MaxElementsPerNode = other.MaxElementsPerNode;
+		MergeRatio = other.MergeRatio;
+		MaintenanceInterval = other.MaintenanceInterval;
+		ZTolerance = other.ZTolerance;
+	}
+
+	// Swaps nodes and handles with other. Settings, OnLeafAssigned and Latency stay with their tree.
+	void SwapContents(TSpatialTree& other)
+	{
+		Swap(Nodes, other.Nodes);
+		Swap(FreeChildBlocks, other.FreeChildBlocks);
+		Swap(ElementsByHandle, other.ElementsByHandle);
+		Swap(HandlesByElement, other.HandlesByElement);
+		Swap(LeavesByHandle, other.LeavesByHandle);
+		Swap(UpdatesSinceMaintenance, other.UpdatesSinceMaintenance);
+	}
+
+	// calls OnLeafAssigned for every handle, for after the contents were swapped in from somewhere else
+	void NotifyLeaves() const
+	{
+		if (!OnLeafAssigned)
+		{
+			return;
+		}
+		for (int32 handle = 0; handle < ElementsByHandle.Num(); ++handle)
+		{
+			OnLeafAssigned(ElementsByHandle[handle], LeavesByHandle[handle]);
+		}
+	}
+
+	// Half open, so a position on a split plane belongs to exactly one child: the one GetChildIndex picks
+	static bool Contains(const FBoundsType& bounds, const FVector3f& position)
+	{
+		bool bInside = position.X >= bounds.Min.X && position.X < bounds.Max.X
+			&& position.Y >= bounds.Min.Y && position.Y < bounds.Max.Y;
+		if constexpr (Dim == 3)
+		{
+			bInside = bInside && position.Z >= bounds.Min.Z && position.Z < bounds.Max.Z;
+		}
+		return bInside;
+	}
+
+	// whether every position within radius of center falls inside bounds, only XY for the quadtree
+	static bool ContainsRegion(const FBoundsType& bounds, const FVector3f& center, float radius)
+	{
+		// the upper side is open like in Contains, a position exactly on Max belongs to the neighbour
+		bool bInside = center.X - radius >= bounds.Min.X && center.X + radius < bounds.Max.X
+			&& center.Y - radius >= bounds.Min.Y && center.Y + radius < bounds.Max.Y;
+		if constexpr (Dim == 3)
+		{
+			bInside = bInside && center.Z - radius >= bounds.Min.Z && center.Z + radius < bounds.Max.Z;
+		}
+		return bInside;
+	}
+
+	// bit 0 is X, bit 1 is Y and bit 2 is Z, a set bit means the upper half
+	static int32 GetChildIndex(const FBoundsType& bounds, const FVector3f& position)
+	{
+		const FVectorType center = bounds.GetCenter();
+		int32 childIndex = int32(position.X >= center.X) | int32(position.Y >= center.Y) << 1;
+		if constexpr (Dim == 3)
+		{
+			childIndex |= int32(position.Z >= center.Z) << 2;
+		}
+		return childIndex;
+	}
+
+	static FBoundsType GetChildBounds(const FBoundsType& bounds, int32 childIndex)
+	{
+		const FVectorType center = bounds.GetCenter();
+		FBoundsType child = bounds;
+		(childIndex & 1 ? child.Min.X : child.Max.X) = center.X;
+		(childIndex & 2 ? child.Min.Y : child.Max.Y) = center.Y;
+		if constexpr (Dim == 3)
+		{
+			(childIndex & 4 ? child.Min.Z : child.Max.Z) = center.Z;
+		}
+		return child;
+	}
+
+	// The leaf that contains position, INDEX_NONE when it is outside the tree. With a startHandle the search
+	// climbs from that element's leaf to the first node containing position instead of starting at the root.
+	int32 FindLeaf(const FVector3f& position, int32 startHandle = INDEX_NONE) const
+	{
+		if (!IsBuilt() || !Contains(Nodes[RootIndex].Bounds, position))
+		{
+			return INDEX_NONE;
+		}
+		int32 nodeIndex = GetLeaf(startHandle);
+		if (nodeIndex == INDEX_NONE)
+		{
+			nodeIndex = RootIndex;
+		}
+		while (nodeIndex != RootIndex && !Contains(Nodes[nodeIndex].Bounds, position))
+		{
+			nodeIndex = Nodes[nodeIndex].Parent;
+		}
+		while (!Nodes[nodeIndex].IsLeaf())
+		{
+			nodeIndex = Nodes[nodeIndex].FirstChild + GetChildIndex(Nodes[nodeIndex].Bounds, position);
+		}
+		return nodeIndex;
+	}
+
+	// returns false when position is outside the tree, an element that is already in it gets moved to position
+	bool Insert(TElement element, const FVector3f& position)
+	{
+		if (!IsBuilt() || !Contains(Nodes[RootIndex].Bounds, position))
+		{
+			return false;
+		}
+		const int32 handle = GetHandle(element);
+		if (FindNode(LeavesByHandle[handle]))
+		{
+			// the handle table knows where it is, so no leaf has to be scanned for duplicates
+			FNode& leaf = Nodes[LeavesByHandle[handle]];
+			leaf.RemoveElementAtSwap(leaf.Handles.Find(handle));
+			LeavesByHandle[handle] = INDEX_NONE;
+		}
+		InsertNode(RootIndex, element, position, handle);
+		return true;
+	}
+
+	// Inserts a batch at once, meant for bulk spawns. The leaves the batch lands in are split serially for the first
+	// BatchSplitLevels levels, every subtree below that is built on a worker into a node pool of its own and spliced
+	// in afterwards, so the workers never share a node and each works on its own range of the batch. Positions outside the tree and elements that are already in
+	// it are skipped. Small batches are cheaper through Insert.
+	void InsertBatch(TArrayView<const TElement> elements, TArrayView<const FVector3f> positions)
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTree_InsertBatch)
+		if (!IsBuilt())
+		{
+			return;
+		}
+		TArray<FBatchItem> items;
+		items.Reserve(elements.Num());
+		for (int32 i = 0; i < elements.Num(); ++i)
+		{
+			if (!Contains(Nodes[RootIndex].Bounds, positions[i]))
+			{
+				continue;
+			}
+			const int32 handle = GetHandle(elements[i]);
+			if (LeavesByHandle[handle] != INDEX_NONE)
+			{
+				continue;
+			}
+			// claimed here so a duplicate further down the batch gets skipped, placing it assigns the real leaf
+			LeavesByHandle[handle] = RootIndex;
+			items.Add({ elements[i], positions[i], handle, FindLeaf(positions[i]) });
+		}
+		if (items.IsEmpty())
+		{
+			return;
+		}
+		// every leaf the batch touches is rebuilt from its own elements plus the new ones
+		const int32 numNew = items.Num();
+		for (int32 i = 0; i < numNew; ++i)
+		{
+			FNode& leaf = Nodes[items[i].Leaf];
+			for (int32 j = 0; j < leaf.Num(); ++j)
+			{
+				items.Add({ leaf.Elements[j], leaf.GetPosition(j), leaf.Handles[j], items[i].Leaf });
+			}
+			leaf.ResetElements();
+		}
+		items.Sort([](const FBatchItem& a, const FBatchItem& b) { return a.Leaf < b.Leaf; });
+
+		TArray<FBatchTask> tasks;
+		TArray<FBatchItem> scratch;
+		for (int32 start = 0; start < items.Num();)
+		{
+			int32 end = start + 1;
+			while (end < items.Num() && items[end].Leaf == items[start].Leaf)
+			{
+				++end;
+			}
+			PartitionBatch(items[start].Leaf, items, start, end - start, BatchSplitLevels, tasks, scratch);
+			start = end;
+		}
+
+		TArray<TSpatialTree> subtrees;
+		subtrees.SetNum(tasks.Num());
+		ParallelFor(tasks.Num(), [this, &tasks, &items, &subtrees](int32 taskIndex)
+		{
+			const FBatchTask& task = tasks[taskIndex];
+			const FNode& node = Nodes[task.NodeIndex];
+			TSpatialTree& subtree = subtrees[taskIndex];
+			subtree.CopySettings(*this);
+			subtree.MaxDepth = MaxDepth - node.Depth;
+			FNode& root = subtree.Nodes.AddDefaulted_GetRef();
+			root.Bounds = node.Bounds;
+			root.bInUse = true;
+			// the same partition all the way down, a leaf ends up split exactly when one insert at a time would split it
+			TArray<FBatchTask> noTasks;
+			TArray<FBatchItem> taskScratch;
+			subtree.PartitionBatch(RootIndex, items, task.Start, task.Num, MAX_int32, noTasks, taskScratch);
+		});
+		// Reserve is exact, growing once for all of them keeps the splices from moving the pool over and over
+		int32 numSplicedNodes = 0;
+		for (const TSpatialTree& subtree : subtrees)
+		{
+			numSplicedNodes += subtree.Nodes.Num() - 1;
+		}
+		Nodes.Reserve(Nodes.Num() + numSplicedNodes);
+		for (int32 taskIndex = 0; taskIndex < tasks.Num(); ++taskIndex)
+		{
+			SpliceSubtree(tasks[taskIndex].NodeIndex, subtrees[taskIndex]);
+		}
+	}
+
+	// finds the leaf from the handle, for callers that don't cache it
+	void Remove(TElement element)
+	{
+		if (const int32* handle = HandlesByElement.Find(element))
+		{
+			Remove(LeavesByHandle[*handle], element);
+		}
+	}
+
+	void Remove(int32 nodeIndex, TElement element)
+	{
+		// cached indices can outlive the block they pointed into
+		if (!FindNode(nodeIndex))
+		{
+			return;
+		}
+		FNode& node = Nodes[nodeIndex];
+		const int32 index = node.Elements.Find(element);
+		if (index != INDEX_NONE)
+		{
+			const int32 handle = node.Handles[index];
+			node.RemoveElementAtSwap(index);
+			AssignLeaf(element, handle, INDEX_NONE);
+		}
+		// emptied nodes get merged by the next maintenance pass, not here
+	}
+
+	// Refreshes the packed positions from getPosition(element, handle) and moves every element that left its leaf,
+	// reinserting it from the lowest ancestor that still contains it. Every MaintenanceInterval calls the subtrees
+	// that thinned out are merged, see Maintain.
+	template <typename PositionFunc>
+	void UpdateAll(PositionFunc&& getPosition)
+	{
+		if (!IsBuilt())
+		{
+			return;
+		}
+		// one pass over the pool picks up every leaf, in the same order every frame
+		MovedElements.Reset();
+		for (int32 nodeIndex = 0; nodeIndex < Nodes.Num(); ++nodeIndex)
+		{
+			FNode& node = Nodes[nodeIndex];
+			if (!node.bInUse || !node.IsLeaf())
+			{
+				continue;
+			}
+			// the one place per frame where element positions get read, queries only see the packed copies.
+			// walking backwards lets RemoveElementAtSwap pull in an element that has already been refreshed
+			for (int32 i = node.Num() - 1; i >= 0; --i)
+			{
+				const FVector3f position = getPosition(node.Elements[i], node.Handles[i]);
+				if (Contains(node.Bounds, position))
+				{
+					node.X[i] = position.X;
+					node.Y[i] = position.Y;
+					node.Z[i] = position.Z;
+					continue;
+				}
+				MovedElements.Add({ node.Elements[i], position, node.Handles[i], nodeIndex });
+				node.RemoveElementAtSwap(i);
+			}
+		}
+
+		// only inserts from here on, so the parent chain of every recorded leaf stays valid
+		for (const FMovedElement& moved : MovedElements)
+		{
+			int32 ancestor = Nodes[moved.Leaf].Parent;
+			while (ancestor != INDEX_NONE && !Contains(Nodes[ancestor].Bounds, moved.Position))
+			{
+				ancestor = Nodes[ancestor].Parent;
+			}
+			if (ancestor == INDEX_NONE)
+			{
+				// outside the world, the owner has to put it back in bounds and insert it again
+				AssignLeaf(moved.Element, moved.Handle, INDEX_NONE);
+				continue;
+			}
+			InsertNode(ancestor, moved.Element, moved.Position, moved.Handle);
+		}
+		if (++UpdatesSinceMaintenance >= MaintenanceInterval)
+		{
+			Maintain();
+		}
+	}
+
+	// merges every subtree holding no more than the merge threshold back into one leaf
+	void Maintain()
+	{
+		if (!IsBuilt())
+		{
+			return;
+		}
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkCollapse, Latency ? &Latency->Collapse : nullptr);
+		UpdatesSinceMaintenance = 0;
+		MergeNode(RootIndex, GetMergeThreshold());
+	}
+
+	int32 GetMergeThreshold() const
+	{
+		return FMath::FloorToInt(MaxElementsPerNode * FMath::Clamp(MergeRatio, 0.f, 1.f));
+	}
+
+	// Brings the tree in line with MaxDepth and MaxElementsPerNode after they changed. Subtrees under the merge
+	// threshold or reaching past MaxDepth are merged first, then every leaf over the limit is split.
+	void Rebalance()
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTree_Rebalance)
+		if (!IsBuilt())
+		{
+			return;
+		}
+		UpdatesSinceMaintenance = 0;
+		MergeNode(RootIndex, GetMergeThreshold());
+		// splits append to the pool, whatever ends up past the current end is already within the limits
+		const int32 numNodes = Nodes.Num();
+		for (int32 nodeIndex = 0; nodeIndex < numNodes; ++nodeIndex)
+		{
+			const FNode& node = Nodes[nodeIndex];
+			if (node.bInUse && node.IsLeaf() && node.Num() > MaxElementsPerNode && node.Depth < MaxDepth)
+			{
+				SplitLeaf(nodeIndex);
+			}
+		}
+	}
+
+	// Lowest node on the path from the leaf of startHandle up to the root whose bounds hold the whole query
+	// region, the root when the handle isn't in the tree. Descending from there finds everything descending
+	// from the root would, and an element that barely moved since its last query rarely has to climb at all.
+	int32 FindQueryStart(int32 startHandle, const FVector3f& center, float radius) const
+	{
+		int32 nodeIndex = GetLeaf(startHandle);
+		if (nodeIndex == INDEX_NONE)
+		{
+			return RootIndex;
+		}
+		while (nodeIndex != RootIndex && !ContainsRegion(Nodes[nodeIndex].Bounds, center, radius))
+		{
+			nodeIndex = Nodes[nodeIndex].Parent;
+		}
+		return nodeIndex;
+	}
+
+	// Every element within radius of center, a circle plus the ZTolerance band for the quadtree.
+	// Every element is stored in exactly one leaf, so the results need no AddUnique.
+	// startHandle is usually the querying element itself, see FindQueryStart.
+	void QueryRadius(const FVector3f& center, float radius, TArray<TElement>& outElements, TElement exclude, int32 startHandle = INDEX_NONE) const
+	{
+		if (IsBuilt())
+		{
+			QueryRadiusNode(FindQueryStart(startHandle, center, radius), center, radius * radius, outElements, exclude, &FNode::Elements);
+		}
+	}
+	// same query, returning element handles instead of the elements
+	void QueryRadiusHandles(const FVector3f& center, float radius, TArray<int32>& outHandles, int32 excludeHandle, int32 startHandle = INDEX_NONE) const
+	{
+		if (IsBuilt())
+		{
+			QueryRadiusNode(FindQueryStart(startHandle, center, radius), center, radius * radius, outHandles, excludeHandle, &FNode::Handles);
+		}
+	}
+
+	// Radius neighbours (the k nearest when k > 0, nearest first) of every element in the tree at its packed position,
+	// worked out a leaf at a time instead of one traversal per element. The candidates around a leaf are gathered
+	// once and every element of the leaf is tested against them and against the rest of its own leaf.
+	// The neighbours of the element with handle h answer query queryIndicesByHandle[h], elements without one are
+	// skipped and queries no element maps to get no neighbours.
+	void QueryRadiusByLeaf(float radius, int32 k, int32 numQueries, TArrayView<const int32> queryIndicesByHandle, TNeighbourBuffer<int32>& outNeighbours) const
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTree_QueryRadiusByLeaf)
+		TArray<int32> leaves;
+		for (int32 nodeIndex = 0; nodeIndex < Nodes.Num(); ++nodeIndex)
+		{
+			const FNode& node = Nodes[nodeIndex];
+			if (node.bInUse && node.IsLeaf() && node.Num() > 0)
+			{
+				leaves.Add(nodeIndex);
+			}
+		}
+		outNeighbours.FillGroups(numQueries, leaves.Num(), [this, &leaves, radius, k, queryIndicesByHandle](int32 groupIndex, TArray<int32>& outQueries, TArray<int32>& outCounts, TArray<int32>& outHandles)
+		{
+			QueryLeaf(leaves[groupIndex], radius, k, queryIndicesByHandle, outQueries, outCounts, outHandles);
+		});
+	}
+
+	// the nodes of the quadtree only split XY, the box still filters on Z per element
+	void QueryBox(const FBox& box, TArray<TElement>& outElements, TElement exclude) const
+	{
+		if (IsBuilt())
+		{
+			QueryBoxNode(RootIndex, box, FTraits::MakeBounds(box), outElements, exclude);
+		}
+	}
+
+	// the k closest elements within maxRadius, appended nearest first
+	void QueryKNearest(const FVector3f& location, int32 k, float maxRadius, TArray<TElement>& outElements, TElement exclude, int32 startHandle = INDEX_NONE) const
+	{
+		CollectKNearest(location, k, maxRadius, outElements, exclude, &FNode::Elements, startHandle);
+	}
+	void QueryKNearestHandles(const FVector3f& location, int32 k, float maxRadius, TArray<int32>& outHandles, int32 excludeHandle, int32 startHandle = INDEX_NONE) const
+	{
+		CollectKNearest(location, k, maxRadius, outHandles, excludeHandle, &FNode::Handles, startHandle);
+	}
+
+private:
+	// items picks what gets reported per match, the elements themselves or their handles
+	template <typename TItem>
+	void CollectKNearest(const FVector3f& location, int32 k, float maxRadius, TArray<TItem>& outItems, TItem exclude, TArray<TItem> FNode::* items, int32 startHandle) const
+	{
+		if (k <= 0 || !IsBuilt())
+		{
+			return;
+		}
+		struct FNodeEntry
+		{
+			double DistanceSquared;
+			int32 NodeIndex;
+		};
+		struct FCandidate
+		{
+			double DistanceSquared;
+			TItem Item;
+		};
+		// nodes come out closest box first, candidates keep the furthest of the best k on top
+		auto closestFirst = [](const FNodeEntry& a, const FNodeEntry& b) { return a.DistanceSquared < b.DistanceSquared; };
+		auto furthestFirst = [](const FCandidate& a, const FCandidate& b) { return a.DistanceSquared > b.DistanceSquared; };
+		TArray<FNodeEntry, TInlineAllocator<64>> nodeQueue;
+		TArray<FCandidate, TInlineAllocator<16>> best;
+
+		const FVectorType queryPoint = FTraits::ToVector(location);
+		double searchRadiusSquared = double(maxRadius) * maxRadius;
+		const int32 startNode = FindQueryStart(startHandle, location, maxRadius);
+		nodeQueue.HeapPush({ Nodes[startNode].Bounds.ComputeSquaredDistanceToPoint(queryPoint), startNode }, closestFirst);
+		while (!nodeQueue.IsEmpty())
+		{
+			FNodeEntry entry;
+			nodeQueue.HeapPop(entry, closestFirst, false);
+			// every node still queued is at least this far away, so none of them can improve the result
+			if (entry.DistanceSquared > searchRadiusSquared)
+			{
+				break;
+			}
+			const FNode& node = Nodes[entry.NodeIndex];
+			if (!node.IsLeaf())
+			{
+				for (int32 i = 0; i < ChildCount; ++i)
+				{
+					const int32 childIndex = node.FirstChild + i;
+					const double childDistanceSquared = Nodes[childIndex].Bounds.ComputeSquaredDistanceToPoint(queryPoint);
+					if (childDistanceSquared <= searchRadiusSquared)
+					{
+						nodeQueue.HeapPush({ childDistanceSquared, childIndex }, closestFirst);
+					}
+				}
+				continue;
+			}
+			const TArray<TItem>& nodeItems = node.*items;
+			for (int32 i = 0; i < node.Num(); ++i)
+			{
+				const float dx = node.X[i] - location.X;
+				const float dy = node.Y[i] - location.Y;
+				const float dz = node.Z[i] - location.Z;
+				double distanceSquared = dx * dx + dy * dy;
+				if constexpr (Dim == 3)
+				{
+					distanceSquared += dz * dz;
+				}
+				else if (FMath::Abs(dz) >= ZTolerance)
+				{
+					continue;
+				}
+				if (nodeItems[i] == exclude || distanceSquared > searchRadiusSquared)
+				{
+					continue;
+				}
+				best.HeapPush({ distanceSquared, nodeItems[i] }, furthestFirst);
+				if (best.Num() > k)
+				{
+					best.HeapPopDiscard(furthestFirst, false);
+				}
+				// once there are k candidates the furthest of them bounds the rest of the search
+				if (best.Num() == k)
+				{
+					searchRadiusSquared = best.HeapTop().DistanceSquared;
+				}
+			}
+		}
+		best.Sort([](const FCandidate& a, const FCandidate& b) { return a.DistanceSquared < b.DistanceSquared; });
+		for (const FCandidate& candidate : best)
+		{
+			outItems.Add(candidate.Item);
+		}
+	}
+
+	// squared distance of an offset when it is within radius, a circle plus the ZTolerance band for the quadtree, else -1
+	float GetDistanceSquaredInRange(float dx, float dy, float dz, float radiusSquared) const
+	{
+		float distanceSquared = dx * dx + dy * dy;
+		if constexpr (Dim == 3)
+		{
+			distanceSquared += dz * dz;
+		}
+		else if (FMath::Abs(dz) >= ZTolerance)
+		{
+			return -1.f;
+		}
+		return distanceSquared <= radiusSquared ? distanceSquared : -1.f;
+	}
+
+	// one group of QueryRadiusByLeaf
+	void QueryLeaf(int32 leafIndex, float radius, int32 k, TArrayView<const int32> queryIndicesByHandle, TArray<int32>& outQueries, TArray<int32>& outCounts, TArray<int32>& outHandles) const
+	{
+		const FNode& leaf = Nodes[leafIndex];
+		const int32 num = leaf.Num();
+		const float radiusSquared = radius * radius;
+
+		// every element of another leaf that is within radius of some point of this one
+		TArray<float, TInlineAllocator<256>> candidateX;
+		TArray<float, TInlineAllocator<256>> candidateY;
+		TArray<float, TInlineAllocator<256>> candidateZ;
+		TArray<int32, TInlineAllocator<256>> candidateHandles;
+		const FBoundsType region = leaf.Bounds.ExpandBy(radius);
+		// climb like FindQueryStart, with a cube around the leaf standing in for the region
+		const FVectorType center = leaf.Bounds.GetCenter();
+		FVector3f regionCenter(center.X, center.Y, 0.f);
+		if constexpr (Dim == 3)
+		{
+			regionCenter.Z = center.Z;
+		}
+		const float reach = float(leaf.Bounds.GetExtent().GetMax()) + radius;
+		int32 startNode = leafIndex;
+		while (startNode != RootIndex && !ContainsRegion(Nodes[startNode].Bounds, regionCenter, reach))
+		{
+			startNode = Nodes[startNode].Parent;
+		}
+		TArray<int32, TInlineAllocator<64>> stack;
+		stack.Add(startNode);
+		while (!stack.IsEmpty())
+		{
+			const FNode& node = Nodes[stack.Pop(false)];
+			if (!node.Bounds.Intersect(region))
+			{
+				continue;
+			}
+			if (!node.IsLeaf())
+			{
+				for (int32 i = 0; i < ChildCount; ++i)
+				{
+					stack.Add(node.FirstChild + i);
+				}
+				continue;
+			}
+			if (&node != &leaf)
+			{
+				candidateX.Append(node.X.GetData(), node.Num());
+				candidateY.Append(node.Y.GetData(), node.Num());
+				candidateZ.Append(node.Z.GetData(), node.Num());
+				candidateHandles.Append(node.Handles.GetData(), node.Num());
+			}
+		}
+
+		auto scan = [this, radiusSquared](const float* x, const float* y, const float* z, const int32* handles, int32 count, const FVector3f& center, TArray<int32>& outScanned, int32 excludeHandle)
+		{
+			if constexpr (Dim == 3)
+			{
+				LeafScan::Sphere(x, y, z, handles, count, center, radiusSquared, outScanned, excludeHandle);
+			}
+			else
+			{
+				LeafScan::CircleBand(x, y, z, handles, count, center, radiusSquared, ZTolerance, outScanned, excludeHandle);
+			}
+		};
+		auto hasQuery = [&leaf, queryIndicesByHandle](int32 i)
+		{
+			return queryIndicesByHandle.IsValidIndex(leaf.Handles[i]) && queryIndicesByHandle[leaf.Handles[i]] != INDEX_NONE;
+		};
+
+		struct FFound
+		{
+			float DistanceSquared;
+			int32 Handle;
+		};
+		struct FPair
+		{
+			int32 A;
+			int32 B;
+			float DistanceSquared;
+		};
+		// pairs inside the leaf are measured once and used for both ends, only the pairs within radius are kept
+		// so the scratch grows with the neighbours found instead of with the square of a leaf that sits at MaxDepth
+		TArray<FPair, TInlineAllocator<64>> pairs;
+		TArray<int32, TInlineAllocator<64>> pairOffsets;
+		pairOffsets.SetNumZeroed(num + 1);
+		for (int32 a = 0; a < num; ++a)
+		{
+			const bool bQueryA = hasQuery(a);
+			for (int32 b = a + 1; b < num; ++b)
+			{
+				if (!bQueryA && !hasQuery(b))
+				{
+					continue;
+				}
+				const float distanceSquared = GetDistanceSquaredInRange(leaf.X[b] - leaf.X[a], leaf.Y[b] - leaf.Y[a], leaf.Z[b] - leaf.Z[a], radiusSquared);
+				if (distanceSquared >= 0.f)
+				{
+					pairs.Add({ a, b, distanceSquared });
+					++pairOffsets[a + 1];
+					++pairOffsets[b + 1];
+				}
+			}
+		}
+		for (int32 i = 0; i < num; ++i)
+		{
+			pairOffsets[i + 1] += pairOffsets[i];
+		}
+		// every element's slice lists its leaf neighbours in leaf order, the same order a scan of the leaf gives
+		TArray<FFound, TInlineAllocator<64>> leafFound;
+		leafFound.SetNumUninitialized(pairOffsets[num]);
+		TArray<int32, TInlineAllocator<64>> fill;
+		fill.SetNumUninitialized(num);
+		for (int32 i = 0; i < num; ++i)
+		{
+			fill[i] = pairOffsets[i];
+		}
+		for (const FPair& pair : pairs)
+		{
+			leafFound[fill[pair.A]++] = { pair.DistanceSquared, leaf.Handles[pair.B] };
+			leafFound[fill[pair.B]++] = { pair.DistanceSquared, leaf.Handles[pair.A] };
+		}
+
+		TArray<FFound, TInlineAllocator<64>> found;
+		for (int32 i = 0; i < num; ++i)
+		{
+			const int32 queryIndex = queryIndicesByHandle.IsValidIndex(leaf.Handles[i]) ? queryIndicesByHandle[leaf.Handles[i]] : INDEX_NONE;
+			if (queryIndex == INDEX_NONE)
+			{
+				continue;
+			}
+			if (k <= 0)
+			{
+				// no distances needed, the candidates go through the same scan a radius query runs on a leaf
+				const int32 before = outHandles.Num();
+				for (int32 j = pairOffsets[i]; j < pairOffsets[i + 1]; ++j)
+				{
+					outHandles.Add(leafFound[j].Handle);
+				}
+				scan(candidateX.GetData(), candidateY.GetData(), candidateZ.GetData(), candidateHandles.GetData(), candidateHandles.Num(), leaf.GetPosition(i), outHandles, INDEX_NONE);
+				outQueries.Add(queryIndex);
+				outCounts.Add(outHandles.Num() - before);
+				continue;
+			}
+			found.Reset();
+			found.Append(leafFound.GetData() + pairOffsets[i], pairOffsets[i + 1] - pairOffsets[i]);
+			for (int32 j = 0; j < candidateHandles.Num(); ++j)
+			{
+				const float distanceSquared = GetDistanceSquaredInRange(candidateX[j] - leaf.X[i], candidateY[j] - leaf.Y[i], candidateZ[j] - leaf.Z[i], radiusSquared);
+				if (distanceSquared >= 0.f)
+				{
+					found.Add({ distanceSquared, candidateHandles[j] });
+				}
+			}
+			found.Sort([](const FFound& a, const FFound& b) { return a.DistanceSquared < b.DistanceSquared; });
+			found.SetNum(FMath::Min(found.Num(), k), false);
+			outQueries.Add(queryIndex);
+			outCounts.Add(found.Num());
+			for (const FFound& neighbour : found)
+			{
+				outHandles.Add(neighbour.Handle);
+			}
+		}
+	}
+
+	int32 AllocateChildBlock()
+	{
+		if (!FreeChildBlocks.IsEmpty())
+		{
+			return FreeChildBlocks.Pop(false);
+		}
+		const int32 firstChild = Nodes.Num();
+		Nodes.AddDefaulted(ChildCount);
+		return firstChild;
+	}
+
+	void FreeChildBlock(int32 firstChild)
+	{
+		for (int32 i = 0; i < ChildCount; ++i)
+		{
+			FNode& child = Nodes[firstChild + i];
+			child.ResetElements();
+			child.FirstChild = INDEX_NONE;
+			child.Parent = INDEX_NONE;
+			child.bInUse = false;
+		}
+		FreeChildBlocks.Push(firstChild);
+	}
+
+	void Subdivide(int32 nodeIndex)
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTree_Subdivide)
+		// allocate first, growing the pool invalidates references into it
+		const int32 firstChild = AllocateChildBlock();
+		FNode& node = Nodes[nodeIndex];
+		for (int32 i = 0; i < ChildCount; ++i)
+		{
+			FNode& child = Nodes[firstChild + i];
+			child.Bounds = GetChildBounds(node.Bounds, i);
+			child.ResetElements();
+			child.FirstChild = INDEX_NONE;
+			child.Parent = nodeIndex;
+			child.Depth = node.Depth + 1;
+			child.bInUse = true;
+		}
+		node.FirstChild = firstChild;
+	}
+
+	// position has to be inside the bounds of nodeIndex and the element can't be in a leaf already, Insert moves it out first
+	void InsertNode(int32 nodeIndex, TElement element, const FVector3f& position, int32 handle)
+	{
+		// the child to descend into follows straight from comparing against the center, no per child bounds tests
+		while (!Nodes[nodeIndex].IsLeaf())
+		{
+			nodeIndex = Nodes[nodeIndex].FirstChild + GetChildIndex(Nodes[nodeIndex].Bounds, position);
+		}
+		// room left, or final depth has been reached and the leaf takes more than its share as a last resort
+		if (Nodes[nodeIndex].Num() < MaxElementsPerNode || Nodes[nodeIndex].Depth >= MaxDepth)
+		{
+			Nodes[nodeIndex].AddElement(element, position, handle);
+			AssignLeaf(element, handle, nodeIndex);
+			return;
+		}
+
+		SplitLeaf(nodeIndex);
+		// the node has children now, so this goes straight down into the child that contains it
+		InsertNode(nodeIndex, element, position, handle);
+	}
+
+	// turns the leaf into an interior node and pushes its elements down into the new children
+	void SplitLeaf(int32 nodeIndex)
+	{
+		// timed with the redistribution below, a cascade of subdivides is what shows up as a spike
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkSubdivide, Latency ? &Latency->Subdivide : nullptr);
+		Subdivide(nodeIndex);
+		// move the elements out first, the inserts below can grow the pool
+		FNode& node = Nodes[nodeIndex];
+		TArray<TElement> parentElements = MoveTemp(node.Elements);
+		TArray<float> parentX = MoveTemp(node.X);
+		TArray<float> parentY = MoveTemp(node.Y);
+		TArray<float> parentZ = MoveTemp(node.Z);
+		TArray<int32> parentHandles = MoveTemp(node.Handles);
+		for (int32 i = 0; i < parentElements.Num(); ++i)
+		{
+			InsertNode(nodeIndex, parentElements[i], FVector3f(parentX[i], parentY[i], parentZ[i]), parentHandles[i]);
+		}
+	}
+
+	// an element of an InsertBatch call and the leaf it landed in when the batch started
+	struct FBatchItem
+	{
+		TElement Element;
+		FVector3f Position;
+		int32 Handle;
+		int32 Leaf;
+	};
+	// a subtree InsertBatch builds on a worker, rooted at NodeIndex from items [Start, Start + Num)
+	struct FBatchTask
+	{
+		int32 NodeIndex;
+		int32 Start;
+		int32 Num;
+	};
+	// levels InsertBatch splits before handing out subtrees, 64 of them below a leaf for either tree
+	static constexpr int32 BatchSplitLevels = Dim == 3 ? 2 : 3;
+
+	// Places items [start, start + num) under the leaf nodeIndex. Anything that fits is added right here, otherwise the
+	// leaf is split and the items sorted over its children until levels runs out and the rest becomes a task.
+	void PartitionBatch(int32 nodeIndex, TArray<FBatchItem>& items, int32 start, int32 num, int32 levels, TArray<FBatchTask>& tasks, TArray<FBatchItem>& scratch)
+	{
+		if (num <= MaxElementsPerNode || Nodes[nodeIndex].Depth >= MaxDepth)
+		{
+			for (int32 i = start; i < start + num; ++i)
+			{
+				Nodes[nodeIndex].AddElement(items[i].Element, items[i].Position, items[i].Handle);
+				AssignLeaf(items[i].Element, items[i].Handle, nodeIndex);
+			}
+			return;
+		}
+		if (levels == 0)
+		{
+			tasks.Add({ nodeIndex, start, num });
+			return;
+		}
+		{
+			GRADWORK_SCOPE_LATENCY(STAT_GradworkSubdivide, Latency ? &Latency->Subdivide : nullptr);
+			Subdivide(nodeIndex);
+		}
+		// counting sort by child, the children's ranges end up back to back in items
+		const FBoundsType bounds = Nodes[nodeIndex].Bounds;
+		int32 childStart[ChildCount + 1] = {};
+		for (int32 i = start; i < start + num; ++i)
+		{
+			++childStart[GetChildIndex(bounds, items[i].Position) + 1];
+		}
+		for (int32 i = 0; i < ChildCount; ++i)
+		{
+			childStart[i + 1] += childStart[i];
+		}
+		int32 cursor[ChildCount];
+		FMemory::Memcpy(cursor, childStart, sizeof(cursor));
+		scratch.SetNum(num, false);
+		for (int32 i = start; i < start + num; ++i)
+		{
+			scratch[cursor[GetChildIndex(bounds, items[i].Position)]++] = items[i];
+		}
+		FMemory::Memcpy(&items[start], scratch.GetData(), num * sizeof(FBatchItem));
+		const int32 firstChild = Nodes[nodeIndex].FirstChild;
+		for (int32 i = 0; i < ChildCount; ++i)
+		{
+			PartitionBatch(firstChild + i, items, start + childStart[i], childStart[i + 1] - childStart[i], levels - 1, tasks, scratch);
+		}
+	}
+
+	// Moves the nodes of a tree InsertBatch built on a worker into the pool, its root becomes nodeIndex.
+	// The subtree never frees a block, so its child blocks stay contiguous once shifted.
+	void SpliceSubtree(int32 nodeIndex, TSpatialTree& subtree)
+	{
+		const int32 offset = Nodes.Num() - 1;
+		const int32 depth = Nodes[nodeIndex].Depth;
+		auto remap = [nodeIndex, offset](int32 index)
+		{
+			return index == INDEX_NONE ? INDEX_NONE : index == RootIndex ? nodeIndex : index + offset;
+		};
+		for (int32 i = 1; i < subtree.Nodes.Num(); ++i)
+		{
+			FNode& node = Nodes.Add_GetRef(MoveTemp(subtree.Nodes[i]));
+			node.FirstChild = remap(node.FirstChild);
+			node.Parent = remap(node.Parent);
+			node.Depth += depth;
+		}
+		FNode& root = subtree.Nodes[RootIndex];
+		FNode& node = Nodes[nodeIndex];
+		node.Elements = MoveTemp(root.Elements);
+		node.X = MoveTemp(root.X);
+		node.Y = MoveTemp(root.Y);
+		node.Z = MoveTemp(root.Z);
+		node.Handles = MoveTemp(root.Handles);
+		node.FirstChild = remap(root.FirstChild);
+		// the subtree had no handle table, its leaves only get assigned now
+		for (int32 i = 0; i < subtree.Nodes.Num(); ++i)
+		{
+			const int32 leafIndex = remap(i);
+			const FNode& leaf = Nodes[leafIndex];
+			for (int32 j = 0; j < leaf.Num(); ++j)
+			{
+				AssignLeaf(leaf.Elements[j], leaf.Handles[j], leafIndex);
+			}
+		}
+	}
+
+	// Returns the number of elements under nodeIndex. Subtrees holding no more than mergeThreshold elements or
+	// reaching past MaxDepth are folded back into nodeIndex on the way up.
+	int32 MergeNode(int32 nodeIndex, int32 mergeThreshold)
+	{
+		if (Nodes[nodeIndex].IsLeaf())
+		{
+			return Nodes[nodeIndex].Num();
+		}
+		const int32 firstChild = Nodes[nodeIndex].FirstChild;
+		int32 count = 0;
+		for (int32 i = 0; i < ChildCount; ++i)
+		{
+			count += MergeNode(firstChild + i, mergeThreshold);
+		}
+		if (count > mergeThreshold && Nodes[nodeIndex].Depth < MaxDepth)
+		{
+			return count;
+		}
+		// the children went through this first, with this few elements below they are all leaves by now
+		FNode& node = Nodes[nodeIndex];
+		for (int32 i = 0; i < ChildCount; ++i)
+		{
+			const FNode& child = Nodes[firstChild + i];
+			for (int32 j = 0; j < child.Num(); ++j)
+			{
+				node.AddElement(child.Elements[j], child.GetPosition(j), child.Handles[j]);
+				AssignLeaf(child.Elements[j], child.Handles[j], nodeIndex);
+			}
+		}
+		node.FirstChild = INDEX_NONE;
+		FreeChildBlock(firstChild);
+		return count;
+	}
+
+	void AssignLeaf(TElement element, int32 handle, int32 nodeIndex)
+	{
+		// the subtrees InsertBatch builds on workers have no handle table, SpliceSubtree assigns their leaves
+		if (!LeavesByHandle.IsValidIndex(handle))
+		{
+			return;
+		}
+		LeavesByHandle[handle] = nodeIndex;
+		if (OnLeafAssigned)
+		{
+			OnLeafAssigned(element, nodeIndex);
+		}
+	}
+
+	template <typename TItem>
+	void QueryRadiusNode(int32 nodeIndex, const FVector3f& center, float radiusSquared, TArray<TItem>& outItems, TItem exclude, TArray<TItem> FNode::* items) const
+	{
+		const FNode& node = Nodes[nodeIndex];
+		// the sphere or circle doesn't reach this node
+		if (node.Bounds.ComputeSquaredDistanceToPoint(FTraits::ToVector(center)) > radiusSquared)
+		{
+			return;
+		}
+		if (!node.IsLeaf())
+		{
+			for (int32 i = 0; i < ChildCount; ++i)
+			{
+				QueryRadiusNode(node.FirstChild + i, center, radiusSquared, outItems, exclude, items);
+			}
+			return;
+		}
+		if constexpr (Dim == 3)
+		{
+			LeafScan::Sphere(node.X.GetData(), node.Y.GetData(), node.Z.GetData(), (node.*items).GetData(), node.Num(),
+				center, radiusSquared, outItems, exclude);
+		}
+		else
+		{
+			LeafScan::CircleBand(node.X.GetData(), node.Y.GetData(), node.Z.GetData(), (node.*items).GetData(), node.Num(),
+				center, radiusSquared, ZTolerance, outItems, exclude);
+		}
+	}
+
+	void QueryBoxNode(int32 nodeIndex, const FBox& box, const FBoundsType& treeBox, TArray<TElement>& outElements, TElement exclude) const
+	{
+		const FNode& node = Nodes[nodeIndex];
+		if (!node.Bounds.Intersect(treeBox))
+		{
+			return;
+		}
+		if (!node.IsLeaf())
+		{
+			for (int32 i = 0; i < ChildCount; ++i)
+			{
+				QueryBoxNode(node.FirstChild + i, box, treeBox, outElements, exclude);
+			}
+			return;
+		}
+		for (int32 i = 0; i < node.Num(); ++i)
+		{
+			if (node.Elements[i] != exclude && box.IsInsideOrOn(FVector(node.GetPosition(i))))
+			{
+				outElements.Add(node.Elements[i]);
+			}
+		}
+	}
+
+	// node pool, the root is always at RootIndex
+	TArray<FNode> Nodes;
+	// first indices of released child blocks, reused by Subdivide
+	TArray<int32> FreeChildBlocks;
+	// every element that has been inserted, indexed by handle
+	TArray<TElement> ElementsByHandle;
+	TMap<TElement, int32> HandlesByElement;
+	// kept up to date by AssignLeaf
+	TArray<int32> LeavesByHandle;
+	// an element that left its leaf during UpdateAll
+	struct FMovedElement
+	{
+		TElement Element;
+		FVector3f Position;
+		int32 Handle;
+		int32 Leaf;
+	};
+	TArray<FMovedElement> MovedElements;
+	int32 UpdatesSinceMaintenance = 0;
+};
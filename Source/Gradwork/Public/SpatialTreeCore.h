@@ -0,0 +1,397 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "SpatialTree.h"
+#include "SpatialTreeTuner.h"
+#include "Tasks/Task.h"
+
+// Everything AQuadTree and AOctree do around their TSpatialTree, so the actors only project actor positions in and
+// keep the blueprint settings. Every operation is timed into Latency, AdaptLimits retunes the limits from those
+// timings, and the tree is double buffered: with bAsyncRebuild set, UpdateAll snapshots the positions and rebuilds
+// a back tree from them on a worker while queries keep reading the front tree, the two swap at the next UpdateAll.
+// Inserts, removes and new handles made in between are recorded and replayed onto the swapped in tree, which is why
+// they have to go through here instead of straight to the tree.
+template <int32 Dim, typename TElement>
+class TSpatialTreeCore
+{
+public:
+	using FTree = TSpatialTree<Dim, TElement>;
+	using FNode = typename FTree::FNode;
+	static constexpr int32 ChildCount = FTree::ChildCount;
+	static constexpr int32 RootIndex = FTree::RootIndex;
+
+	bool bAsyncRebuild = false;
+	// queries made for an element in the tree start at its leaf instead of the root
+	bool bCoherentQueries = true;
+
+	TSpatialTreeCore()
+	{
+		Tree.Latency = &Latency;
+	}
+	~TSpatialTreeCore()
+	{
+		CancelAsyncRebuild();
+	}
+	// the tree points at Latency and the running build captures this
+	TSpatialTreeCore(const TSpatialTreeCore&) = delete;
+	TSpatialTreeCore& operator=(const TSpatialTreeCore&) = delete;
+
+	// the front tree, the one queries read
+	const FTree& GetTree() const { return Tree; }
+	const FGradworkLatencyStats& GetLatency() const { return Latency; }
+	// once per frame, after the last operation of the frame
+	void PublishFrame() { Latency.PublishFrame(); }
+
+	void SetOnLeafAssigned(TFunction<void(TElement, int32)> onLeafAssigned)
+	{
+		Tree.OnLeafAssigned = MoveTemp(onLeafAssigned);
+	}
+	// take effect at the next Build, UpdateAll or Rebalance
+	void SetLimits(int32 maxDepth, int32 maxElementsPerNode, float mergeRatio, int32 maintenanceInterval)
+	{
+		// the owners pass their settings every frame, only limits edited from outside make the tuner start over
+		if (maxDepth != Tree.MaxDepth || maxElementsPerNode != Tree.MaxElementsPerNode)
+		{
+			ResetTuner();
+		}
+		Tree.MaxDepth = maxDepth;
+		Tree.MaxElementsPerNode = maxElementsPerNode;
+		Tree.MergeRatio = mergeRatio;
+		Tree.MaintenanceInterval = maintenanceInterval;
+	}
+	void SetZTolerance(float zTolerance)
+	{
+		Tree.ZTolerance = zTolerance;
+	}
+
+	bool IsBuilt() const { return Tree.IsBuilt(); }
+	void Build(const FBox& bounds)
+	{
+		Bounds = bounds;
+		Tree.Build(bounds);
+		ResetTuner();
+	}
+
+	// drops the running build and everything in the tree
+	void Reset()
+	{
+		CancelAsyncRebuild();
+		Tree.Reset();
+		ResetTuner();
+	}
+
+	int32 GetHandle(TElement element)
+	{
+		const int32 numHandles = Tree.GetNumHandles();
+		const int32 handle = Tree.GetHandle(element);
+		if (RebuildTask.IsValid() && Tree.GetNumHandles() != numHandles)
+		{
+			PendingChanges.Add({ element, FVector3f::ZeroVector, EChange::Handle });
+		}
+		return handle;
+	}
+
+	bool Insert(TElement element, const FVector3f& position)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkInsert, &Latency.Insert);
+		if (!Tree.Insert(element, position))
+		{
+			return false;
+		}
+		if (RebuildTask.IsValid())
+		{
+			PendingChanges.Add({ element, position, EChange::Insert });
+		}
+		return true;
+	}
+
+	// One sample for the whole batch would skew the Insert histogram, so it only shows up in "stat Gradwork"
+	void InsertBatch(TArrayView<const TElement> elements, TArrayView<const FVector3f> positions)
+	{
+		SCOPE_CYCLE_COUNTER(STAT_GradworkInsert);
+		if (!RebuildTask.IsValid() || !Tree.IsBuilt())
+		{
+			Tree.InsertBatch(elements, positions);
+			return;
+		}
+		// The replay inserts unconditionally, so only what the batch actually places gets recorded: the first
+		// occurrence of every element that was inside the bounds and not in the tree yet.
+		const typename FTree::FBoundsType rootBounds = Tree.GetNodes()[FTree::RootIndex].Bounds;
+		TArray<bool> bPlaced;
+		bPlaced.SetNumUninitialized(elements.Num());
+		for (int32 i = 0; i < elements.Num(); ++i)
+		{
+			const int32 handle = Tree.FindHandle(elements[i]);
+			bPlaced[i] = FTree::Contains(rootBounds, positions[i]) && (handle == INDEX_NONE || Tree.GetLeaf(handle) == INDEX_NONE);
+		}
+		Tree.InsertBatch(elements, positions);
+		TArray<bool> bRecorded;
+		bRecorded.Init(false, Tree.GetNumHandles());
+		for (int32 i = 0; i < elements.Num(); ++i)
+		{
+			const int32 handle = bPlaced[i] ? Tree.FindHandle(elements[i]) : INDEX_NONE;
+			if (handle != INDEX_NONE && !bRecorded[handle])
+			{
+				bRecorded[handle] = true;
+				PendingChanges.Add({ elements[i], positions[i], EChange::Insert });
+			}
+		}
+	}
+
+	void Remove(int32 nodeIndex, TElement element)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkRemove, &Latency.Remove);
+		Tree.Remove(nodeIndex, element);
+		if (RebuildTask.IsValid())
+		{
+			PendingChanges.Add({ element, FVector3f::ZeroVector, EChange::Remove });
+		}
+	}
+
+	// Refreshes the tree from getPosition(element, handle), in place or by starting the next background build
+	template <typename PositionFunc>
+	void UpdateAll(PositionFunc&& getPosition)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkUpdate, &Latency.Update);
+		if (!bAsyncRebuild)
+		{
+			// switched off since the last update, the running build is still the most recent state
+			FinishAsyncRebuild();
+			Tree.UpdateAll(getPosition);
+			return;
+		}
+
+		FinishAsyncRebuild();
+		// the worker only ever reads the snapshot, the front tree stays with the game thread
+		const int32 numHandles = Tree.GetNumHandles();
+		SnapshotElements.SetNumUninitialized(numHandles);
+		SnapshotPositions.SetNumUninitialized(numHandles);
+		SnapshotInTree.SetNumUninitialized(numHandles);
+		for (int32 handle = 0; handle < numHandles; ++handle)
+		{
+			TElement element = Tree.GetElement(handle);
+			SnapshotElements[handle] = element;
+			SnapshotInTree[handle] = Tree.GetLeaf(handle) != INDEX_NONE;
+			SnapshotPositions[handle] = SnapshotInTree[handle] ? getPosition(element, handle) : FVector3f::ZeroVector;
+		}
+		BackTree.CopySettings(Tree);
+		RebuildTask = UE::Tasks::Launch(UE_SOURCE_LOCATION, [this]()
+		{
+			BackTree.BuildFrom(Bounds, SnapshotElements, SnapshotPositions, SnapshotInTree);
+		});
+	}
+
+	// handle of the querying element when its leaf is where queries should start, see bCoherentQueries
+	int32 GetQueryStart(TElement queryInstigator) const
+	{
+		return bCoherentQueries ? Tree.FindHandle(queryInstigator) : INDEX_NONE;
+	}
+
+	// the elements of the leaf that contains position, except exclude, whose packed position passes filter
+	template <typename FilterFunc>
+	void QueryLeaf(const FVector3f& position, TArray<TElement>& outElements, TElement exclude, FilterFunc&& filter)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+		// found from the instigator's leaf when it is in the tree
+		if (const FNode* leaf = Tree.FindNode(Tree.FindLeaf(position, GetQueryStart(exclude))))
+		{
+			for (int32 i = 0; i < leaf->Num(); ++i)
+			{
+				if (leaf->Elements[i] != exclude && filter(leaf->GetPosition(i)))
+				{
+					outElements.AddUnique(leaf->Elements[i]);
+				}
+			}
+		}
+	}
+
+	void QueryRadius(const FVector3f& center, float radius, TArray<TElement>& outElements, TElement exclude)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+		Tree.QueryRadius(center, radius, outElements, exclude, GetQueryStart(exclude));
+	}
+
+	void QueryBox(const FBox& box, TArray<TElement>& outElements, TElement exclude)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+		Tree.QueryBox(box, outElements, exclude);
+	}
+
+	void QueryKNearest(const FVector3f& location, int32 k, float maxRadius, TArray<TElement>& outElements, TElement exclude)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQuery, &Latency.Query);
+		Tree.QueryKNearest(location, k, maxRadius, outElements, exclude, GetQueryStart(exclude));
+	}
+
+	// a radius query (k nearest when k > 0) per location in parallel, instigators[i] is left out of query i
+	void QueryBatch(TArrayView<const FVector> locations, float radius, int32 k, TNeighbourBuffer<TElement>& outNeighbours, TArrayView<const TElement> instigators)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQueryBatch, &Latency.QueryBatch);
+		// only const query paths in here, they run concurrently
+		outNeighbours.Fill(locations.Num(), [this, locations, radius, k, instigators](int32 queryIndex, TArray<TElement>& out)
+		{
+			const TElement queryInstigator = instigators.IsValidIndex(queryIndex) ? instigators[queryIndex] : TElement();
+			if (k > 0)
+			{
+				Tree.QueryKNearest(FVector3f(locations[queryIndex]), k, radius, out, queryInstigator, GetQueryStart(queryInstigator));
+				return;
+			}
+			Tree.QueryRadius(FVector3f(locations[queryIndex]), radius, out, queryInstigator, GetQueryStart(queryInstigator));
+		});
+	}
+
+	// QueryBatch with handles in and out, excludeHandles[i] is left out of query i
+	void QueryBatchHandles(TArrayView<const FVector3f> locations, float radius, int32 k, TNeighbourBuffer<int32>& outNeighbours, TArrayView<const int32> excludeHandles)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQueryBatch, &Latency.QueryBatch);
+		outNeighbours.Fill(locations.Num(), [this, locations, radius, k, excludeHandles](int32 queryIndex, TArray<int32>& out)
+		{
+			const int32 excludeHandle = excludeHandles.IsValidIndex(queryIndex) ? excludeHandles[queryIndex] : INDEX_NONE;
+			const int32 startHandle = bCoherentQueries ? excludeHandle : INDEX_NONE;
+			if (k > 0)
+			{
+				Tree.QueryKNearestHandles(locations[queryIndex], k, radius, out, excludeHandle, startHandle);
+				return;
+			}
+			Tree.QueryRadiusHandles(locations[queryIndex], radius, out, excludeHandle, startHandle);
+		});
+	}
+
+	// see TSpatialTree::QueryRadiusByLeaf
+	void QueryBatchByLeaf(float radius, int32 k, int32 numQueries, TArrayView<const int32> queryIndicesByHandle, TNeighbourBuffer<int32>& outNeighbours)
+	{
+		GRADWORK_SCOPE_LATENCY(STAT_GradworkQueryBatch, &Latency.QueryBatch);
+		Tree.QueryRadiusByLeaf(radius, k, numQueries, queryIndicesByHandle, outNeighbours);
+	}
+
+	// Hands the tuner the costs and shape once interval seconds have passed, then applies what it picked and
+	// rebalances. inOutMaxDepth and inOutMaxElementsPerNode are the owner's copies, returns true when they moved.
+	bool AdaptLimits(float deltaTime, float interval, int32& inOutMaxDepth, int32& inOutMaxElementsPerNode)
+	{
+		if (!Tree.IsBuilt())
+		{
+			return false;
+		}
+		AdaptTime += deltaTime;
+		++AdaptFrames;
+		if (AdaptTime < interval)
+		{
+			return false;
+		}
+		TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTreeCore_AdaptLimits)
+		const bool bChanged = Tuner.Evaluate(Latency, Tree.GetStats(), AdaptFrames, inOutMaxDepth, inOutMaxElementsPerNode);
+		if (bChanged)
+		{
+			// a build still running was started with the old limits, swapping it in later would undo the rebalance
+			FinishAsyncRebuild();
+			Tree.MaxDepth = inOutMaxDepth;
+			Tree.MaxElementsPerNode = inOutMaxElementsPerNode;
+			Tree.Rebalance();
+		}
+		AdaptTime = 0.f;
+		AdaptFrames = 0;
+		return bChanged;
+	}
+
+	// waits for the background build, swaps it in and replays the changes made since its snapshot
+	void FinishAsyncRebuild()
+	{
+		if (!RebuildTask.IsValid())
+		{
+			return;
+		}
+		{
+			TRACE_CPUPROFILER_EVENT_SCOPE(TSpatialTreeCore_WaitForRebuild)
+			RebuildTask.Wait();
+		}
+		RebuildTask = UE::Tasks::FTask();
+		Tree.SwapContents(BackTree);
+		// Replayed in the order the front tree saw them, so every handle it gave out since the snapshot is given out
+		// again in the same order, only the recorded Handle changes and the inserts of elements the snapshot never
+		// saw mint one.
+		// a copy, the inserts below can grow the node pool
+		const typename FTree::FBoundsType rootBounds = Tree.GetNodes()[FTree::RootIndex].Bounds;
+		for (const FPendingChange& change : PendingChanges)
+		{
+			switch (change.Type)
+			{
+			case EChange::Handle:
+				Tree.GetHandle(change.Element);
+				break;
+			case EChange::Insert:
+			{
+				// an element the snapshot already placed gets moved to where the front tree put it since
+				if (FTree::Contains(rootBounds, change.Position))
+				{
+					Tree.Insert(change.Element, change.Position);
+				}
+				break;
+			}
+			case EChange::Remove:
+				Tree.Remove(change.Element);
+				break;
+			}
+		}
+		PendingChanges.Reset();
+		Tree.NotifyLeaves();
+	}
+
+	// waits for the background build and throws it away
+	void CancelAsyncRebuild()
+	{
+		if (RebuildTask.IsValid())
+		{
+			RebuildTask.Wait();
+			RebuildTask = UE::Tasks::FTask();
+		}
+		PendingChanges.Reset();
+		BackTree.Reset();
+	}
+
+	SIZE_T GetAllocatedSize() const
+	{
+		// the back tree is the worker's while a build runs
+		return Tree.GetAllocatedSize() + (RebuildTask.IsValid() ? 0 : BackTree.GetAllocatedSize()) + SnapshotElements.GetAllocatedSize()
+			+ SnapshotPositions.GetAllocatedSize() + SnapshotInTree.GetAllocatedSize() + PendingChanges.GetAllocatedSize();
+	}
+
+private:
+	enum class EChange : uint8
+	{
+		Handle,
+		Insert,
+		Remove
+	};
+	struct FPendingChange
+	{
+		TElement Element;
+		FVector3f Position;
+		EChange Type;
+	};
+
+	// what the tuner measured was for the old limits or the old tree
+	void ResetTuner()
+	{
+		Tuner.Reset();
+		AdaptTime = 0.f;
+		AdaptFrames = 0;
+	}
+
+	FTree Tree;
+	FBox Bounds = FBox(ForceInit);
+	// per operation latency histograms, the owner logs them and publishes them to the csv profiler every frame
+	FGradworkLatencyStats Latency;
+	FSpatialTreeTuner Tuner;
+	float AdaptTime = 0.f;
+	int32 AdaptFrames = 0;
+	// built by RebuildTask from the snapshot, nothing else touches these while it runs
+	FTree BackTree;
+	UE::Tasks::FTask RebuildTask;
+	TArray<TElement> SnapshotElements;
+	TArray<FVector3f> SnapshotPositions;
+	TArray<bool> SnapshotInTree;
+	// made on the front tree while a build was running
+	TArray<FPendingChange> PendingChanges;
+};
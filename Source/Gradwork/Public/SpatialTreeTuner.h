@@ -0,0 +1,46 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GradworkStats.h"
+
+// Picks MaxDepth and MaxElementsPerNode for a tree whose density keeps changing. Meant to be called every
+// so many frames with the tree's latency histograms and shape:
+// - MaxDepth goes up while too many leaves sit at MaxDepth over capacity, they can't split any further.
+// - MaxDepth comes down while most leaves at MaxDepth are under-filled and merging them wouldn't put them over
+//   capacity. The next call puts it back up if the queries got slower for it, and the tuner stays above that
+//   depth until Reset.
+// - MaxElementsPerNode hill climbs on the measured query and update cost per element and frame, a step that
+//   made it more expensive gets reversed and it stays put while the cost holds steady.
+// The caller applies the limits and rebalances the tree when Evaluate returns true.
+struct GRADWORK_API FSpatialTreeTuner
+{
+	int32 MaxDepthLimit = 10;
+	int32 MinDepthLimit = 2;
+	int32 MinElementsPerNode = 2;
+	int32 MaxElementsPerNodeLimit = 64;
+	// relative cost change that counts as noise
+	double Tolerance = 0.1;
+	// share of the occupied leaves allowed to be stuck over capacity at MaxDepth
+	double OverCapacityShare = 0.05;
+	// a leaf holding no more than this share of MaxElementsPerNode is under-filled
+	double UnderFillRatio = 0.5;
+	// share of the occupied leaves at MaxDepth that has to be under-filled before MaxDepth comes down
+	double UnderFilledShare = 0.75;
+
+	// numFrames is the number of frames since the last call, returns true when either limit changed
+	bool Evaluate(const FGradworkLatencyStats& latency, const FSpatialTreeStats& stats, int32 numFrames, int32& inOutMaxDepth, int32& inOutMaxElementsPerNode);
+	// forgets the measurements, for when the limits or the tree are set up again from outside
+	void Reset();
+
+private:
+	uint64 LastCycles = 0;
+	uint64 LastQueryCycles = 0;
+	double LastCost = -1.0;
+	// query cost per element and frame before the last lowering of MaxDepth, -1 when there is none to check
+	double QueryCostBeforeShallower = -1.0;
+	int32 DepthFloor = 0;
+	bool bHasBaseline = false;
+	int32 Direction = 1;
+};
@@ -0,0 +1,127 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Blended flocking over packed neighbour data. One pass over the neighbours gathers everything
+// separation, alignment and cohesion need, four neighbours per step.
+namespace Steering
+{
+	// one agent's neighbours as flat arrays, filled per agent and reused
+	struct FNeighbourData
+	{
+		TArray<float, TInlineAllocator<64>> X;
+		TArray<float, TInlineAllocator<64>> Y;
+		TArray<float, TInlineAllocator<64>> Z;
+		TArray<float, TInlineAllocator<64>> VelocityX;
+		TArray<float, TInlineAllocator<64>> VelocityY;
+		TArray<float, TInlineAllocator<64>> VelocityZ;
+
+		int32 Num() const { return X.Num(); }
+		void Add(const FVector3f& position, const FVector3f& velocity)
+		{
+			X.Add(position.X);
+			Y.Add(position.Y);
+			Z.Add(position.Z);
+			VelocityX.Add(velocity.X);
+			VelocityY.Add(velocity.Y);
+			VelocityZ.Add(velocity.Z);
+		}
+		void Reset()
+		{
+			X.Reset();
+			Y.Reset();
+			Z.Reset();
+			VelocityX.Reset();
+			VelocityY.Reset();
+			VelocityZ.Reset();
+		}
+	};
+
+	struct FNeighbourSums
+	{
+		// sum of the unit vectors pointing away from every neighbour closer than the separation range
+		FVector3f Separation = FVector3f::ZeroVector;
+		FVector3f Velocity = FVector3f::ZeroVector;
+		FVector3f Position = FVector3f::ZeroVector;
+		int32 Count = 0;
+	};
+
+	inline float HorizontalAdd(const VectorRegister4Float& value)
+	{
+		float lanes[4];
+		VectorStore(value, lanes);
+		return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	inline FNeighbourSums Accumulate(const FNeighbourData& neighbours, const FVector3f& position, float separationRange)
+	{
+		const VectorRegister4Float zero = VectorZeroFloat();
+		const VectorRegister4Float positionX = VectorSetFloat1(position.X);
+		const VectorRegister4Float positionY = VectorSetFloat1(position.Y);
+		const VectorRegister4Float positionZ = VectorSetFloat1(position.Z);
+		const VectorRegister4Float rangeSquared = VectorSetFloat1(separationRange * separationRange);
+		VectorRegister4Float separationX = zero, separationY = zero, separationZ = zero;
+		VectorRegister4Float velocityX = zero, velocityY = zero, velocityZ = zero;
+		VectorRegister4Float sumX = zero, sumY = zero, sumZ = zero;
+
+		const int32 num = neighbours.Num();
+		int32 i = 0;
+		for (; i + 4 <= num; i += 4)
+		{
+			const VectorRegister4Float x = VectorLoad(neighbours.X.GetData() + i);
+			const VectorRegister4Float y = VectorLoad(neighbours.Y.GetData() + i);
+			const VectorRegister4Float z = VectorLoad(neighbours.Z.GetData() + i);
+			const VectorRegister4Float dx = VectorSubtract(x, positionX);
+			const VectorRegister4Float dy = VectorSubtract(y, positionY);
+			const VectorRegister4Float dz = VectorSubtract(z, positionZ);
+			const VectorRegister4Float distanceSquared = VectorMultiplyAdd(dz, dz, VectorMultiplyAdd(dy, dy, VectorMultiply(dx, dx)));
+			// lanes out of range or right on top of us get a zero weight instead of a branch
+			const VectorRegister4Float inRange = VectorBitwiseAnd(VectorCompareGT(distanceSquared, zero), VectorCompareLT(distanceSquared, rangeSquared));
+			const VectorRegister4Float inverseDistance = VectorSelect(inRange, VectorReciprocalSqrtAccurate(distanceSquared), zero);
+			separationX = VectorNegateMultiplyAdd(dx, inverseDistance, separationX);
+			separationY = VectorNegateMultiplyAdd(dy, inverseDistance, separationY);
+			separationZ = VectorNegateMultiplyAdd(dz, inverseDistance, separationZ);
+			velocityX = VectorAdd(velocityX, VectorLoad(neighbours.VelocityX.GetData() + i));
+			velocityY = VectorAdd(velocityY, VectorLoad(neighbours.VelocityY.GetData() + i));
+			velocityZ = VectorAdd(velocityZ, VectorLoad(neighbours.VelocityZ.GetData() + i));
+			sumX = VectorAdd(sumX, x);
+			sumY = VectorAdd(sumY, y);
+			sumZ = VectorAdd(sumZ, z);
+		}
+
+		FNeighbourSums sums;
+		sums.Separation = FVector3f(HorizontalAdd(separationX), HorizontalAdd(separationY), HorizontalAdd(separationZ));
+		sums.Velocity = FVector3f(HorizontalAdd(velocityX), HorizontalAdd(velocityY), HorizontalAdd(velocityZ));
+		sums.Position = FVector3f(HorizontalAdd(sumX), HorizontalAdd(sumY), HorizontalAdd(sumZ));
+		// leftovers that don't fill a register
+		for (; i < num; ++i)
+		{
+			const FVector3f neighbour(neighbours.X[i], neighbours.Y[i], neighbours.Z[i]);
+			const FVector3f toNeighbour = neighbour - position;
+			const float distanceSquared = toNeighbour.SizeSquared();
+			if (distanceSquared > 0.f && distanceSquared < separationRange * separationRange)
+			{
+				sums.Separation -= toNeighbour * FMath::InvSqrt(distanceSquared);
+			}
+			sums.Velocity += FVector3f(neighbours.VelocityX[i], neighbours.VelocityY[i], neighbours.VelocityZ[i]);
+			sums.Position += neighbour;
+		}
+		sums.Count = num;
+		return sums;
+	}
+
+	// separation, the average neighbour velocity and the pull towards the neighbours' centroid, each scaled by its weight
+	inline FVector3f Blend(const FNeighbourSums& sums, const FVector3f& position, float separationWeight, float alignmentWeight, float cohesionWeight)
+	{
+		if (sums.Count == 0)
+		{
+			return FVector3f::ZeroVector;
+		}
+		const float inverseCount = 1.f / sums.Count;
+		return sums.Separation * separationWeight
+			+ sums.Velocity * (inverseCount * alignmentWeight)
+			+ (sums.Position * inverseCount - position) * cohesionWeight;
+	}
+}
@@ -0,0 +1,61 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+// Trajectory files are a fixed size header followed by one frame after the other,
+// each frame being the position of every agent as packed FVector3f, little endian.
+struct FTrajectoryHeader
+{
+	static constexpr uint32 FileMagic = 0x52545747; // "GWTR"
+	static constexpr uint32 FileVersion = 1;
+	// keeps the frames 16 byte aligned in the mapped file
+	static constexpr int64 Size = 48;
+
+	uint32 Magic = FileMagic;
+	uint32 Version = FileVersion;
+	int32 NumAgents = 0;
+	// only filled in on Close, a file that was never closed gets its frame count from its size
+	int32 NumFrames = 0;
+	FVector3f BoundsMin = FVector3f::ZeroVector;
+	FVector3f BoundsMax = FVector3f::ZeroVector;
+};
+
+// streams frames straight to disk, nothing but the header is kept in memory
+class GRADWORK_API FTrajectoryWriter
+{
+public:
+	~FTrajectoryWriter();
+	bool Open(const FString& path, int32 numAgents, const FBox& bounds);
+	// frames with a different agent count than the file was opened with are dropped
+	void AddFrame(TArrayView<const FVector3f> positions);
+	void Close();
+	bool IsOpen() const { return Archive.IsValid(); }
+	int32 GetNumFrames() const { return Header.NumFrames; }
+private:
+	void WriteHeader();
+	TUniquePtr<FArchive> Archive;
+	FTrajectoryHeader Header;
+};
+
+// maps the whole file, frames are handed out as views straight into the mapping
+class GRADWORK_API FTrajectoryReader
+{
+public:
+	FTrajectoryReader();
+	~FTrajectoryReader();
+	bool Open(const FString& path);
+	int32 GetNumAgents() const { return Header.NumAgents; }
+	int32 GetNumFrames() const { return Header.NumFrames; }
+	FBox GetBounds() const { return FBox(FVector(Header.BoundsMin), FVector(Header.BoundsMax)); }
+	TArrayView<const FVector3f> GetFrame(int32 frame) const;
+private:
+	TUniquePtr<IMappedFileHandle> MappedFile;
+	TUniquePtr<IMappedFileRegion> MappedRegion;
+	FTrajectoryHeader Header;
+	const FVector3f* Frames = nullptr;
+};